@@ -0,0 +1,856 @@
+#include "waves.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+   Benchmark suite, run with `make bench`.
+
+   bench [-s seconds] [-t threads] [-g]
+
+   Renders a matrix of patches varying operator count, graph depth, fan-out,
+   feedback, polyphony and waveform type, and prints one JSON object per case
+   with the cost per frame, the cost per voice and frame, and the number of
+   voices a single core can render in real time. Topologies with a
+   specialized kernel, and a few rendered with voices in SIMD lanes, are also
+   rendered with the generic renderer, followed by an object with the speedup.
+
+   Then renders a set of golden patches, in mono and panned in stereo, with
+   both the engine and a naive double precision reference renderer, and
+   checks that the engine stays within GOLDEN_TOLERANCE of the reference, and
+   that it renders the same output bit for bit with several render threads.
+   Exits with 1 if any golden check fails. With -g only the golden checks are
+   run.
+*/
+
+#define SAMPLE_RATE 48000
+#define BLOCK_FRAMES 256
+#define DEFAULT_SECONDS 1.0
+
+// Maximum absolute difference from the reference renderer, for a full scale
+// of 1. Dominated by the linear interpolation of the wavetables and the
+// single precision envelopes.
+#define GOLDEN_TOLERANCE 2e-3
+#define GOLDEN_SECONDS 1.0
+#define GOLDEN_RELEASE 0.5
+#define GOLDEN_VELOCITY 100
+
+#define MAX_BENCH_OPS 32
+#define MAX_BENCH_EDGES 64
+#define MAX_BENCH_ROUTES 8
+// Edge target of the audible output
+#define OUT -1
+// Source of the macro every patch has, see patch_build()
+#define MACRO (WAVES_SOURCE_KEY + 1)
+
+typedef struct {
+    WaveformType type;
+    float ratio;
+    float output_amplitude;
+    float modulation_amplitude;
+    Envelope envelope;
+} BenchOp;
+
+typedef struct {
+    WavesSource source;
+    int op;
+    WaveformParameter parameter;
+    float depth;
+} BenchRoute;
+
+// A patch built both into an engine and the reference renderer. Operators
+// are listed modulators first, an edge whose source is not listed before
+// its target closes a cycle and is read with a one frame delay, as the
+// engine does.
+typedef struct {
+    const char *name;
+    BenchOp ops[MAX_BENCH_OPS];
+    int op_count;
+    int edges[MAX_BENCH_EDGES][2];
+    int edge_count;
+    BenchRoute routes[MAX_BENCH_ROUTES];
+    int route_count;
+    // The macro is set to `macro_value` at `macro_frame` of the golden run
+    size_t macro_frame;
+    float macro_value;
+} BenchPatch;
+
+static const Envelope sustained = {.attack = 0.01, .sustain = 1.0};
+
+static const char *waveform_names[] = {"sine", "triangle", "saw", "square"};
+
+static void patch_add_op(BenchPatch *patch, WaveformType type, float ratio,
+                         float output_amplitude, float modulation_amplitude) {
+    patch->ops[patch->op_count++] = (BenchOp){
+        .type = type,
+        .ratio = ratio,
+        .output_amplitude = output_amplitude,
+        .modulation_amplitude = modulation_amplitude,
+        .envelope = sustained,
+    };
+}
+
+static void patch_connect(BenchPatch *patch, int from, int to) {
+    patch->edges[patch->edge_count][0] = from;
+    patch->edges[patch->edge_count][1] = to;
+    patch->edge_count++;
+}
+
+static void patch_route(BenchPatch *patch, WavesSource source, int op,
+                        WaveformParameter parameter, float depth) {
+    patch->routes[patch->route_count++] = (BenchRoute){
+        .source = source,
+        .op = op,
+        .parameter = parameter,
+        .depth = depth,
+    };
+}
+
+// `depth` operators in a chain, each modulating the next, the last one
+// audible.
+static BenchPatch patch_stack(int depth, WaveformType type) {
+    BenchPatch patch = {0};
+    for (int i = 0; i < depth; i++) {
+        patch_add_op(&patch, type, i + 1, 0.2, 1.5);
+        if (i)
+            patch_connect(&patch, i - 1, i);
+    }
+    patch_connect(&patch, depth - 1, OUT);
+    return patch;
+}
+
+// `count` audible chains of `depth` sine operators, like patch_stack().
+static BenchPatch patch_stacks(int count, int depth) {
+    BenchPatch patch = {0};
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < depth; j++) {
+            patch_add_op(&patch, WAVES_WAVEFORM_SINE, i + j + 1, 0.2 / count,
+                         1.5);
+            if (j)
+                patch_connect(&patch, patch.op_count - 2, patch.op_count - 1);
+        }
+        patch_connect(&patch, patch.op_count - 1, OUT);
+    }
+    return patch;
+}
+
+// `count` independent audible operators.
+static BenchPatch patch_parallel(int count) {
+    BenchPatch patch = {0};
+    for (int i = 0; i < count; i++) {
+        patch_add_op(&patch, WAVES_WAVEFORM_SINE, i + 1, 0.2 / count, 0);
+        patch_connect(&patch, i, OUT);
+    }
+    return patch;
+}
+
+// A single modulator feeding `count` audible operators.
+static BenchPatch patch_fanout(int count) {
+    BenchPatch patch = {0};
+    patch_add_op(&patch, WAVES_WAVEFORM_SINE, 2, 0, 1.0);
+    for (int i = 0; i < count; i++) {
+        patch_add_op(&patch, WAVES_WAVEFORM_SINE, i + 1, 0.2 / count, 0);
+        patch_connect(&patch, 0, i + 1);
+        patch_connect(&patch, i + 1, OUT);
+    }
+    return patch;
+}
+
+// patch_fanout() as a patch editor might leave it: every audible operator has
+// its own copy of the modulator, and a muted modulator of its own.
+static BenchPatch patch_redundant(int count) {
+    BenchPatch patch = {0};
+    for (int i = 0; i < count; i++) {
+        patch_add_op(&patch, WAVES_WAVEFORM_SINE, 2, 0, 1.0);
+        patch_add_op(&patch, WAVES_WAVEFORM_SINE, 3, 0, 0);
+        patch_add_op(&patch, WAVES_WAVEFORM_SINE, i + 1, 0.2 / count, 0);
+        patch_connect(&patch, 3 * i, 3 * i + 2);
+        patch_connect(&patch, 3 * i + 1, 3 * i + 2);
+        patch_connect(&patch, 3 * i + 2, OUT);
+    }
+    return patch;
+}
+
+static WavesEngine *patch_build(const BenchPatch *patch, size_t threads) {
+    WavesEngine *engine = waves_engine_create(SAMPLE_RATE);
+    waves_set_render_threads(engine, threads);
+    if (waves_new_macro(engine, "macro") != MACRO)
+        abort();
+
+    WaveformHandle handles[MAX_BENCH_OPS];
+    for (int i = 0; i < patch->op_count; i++) {
+        const BenchOp *op = patch->ops + i;
+        handles[i] =
+            waves_new_waveform(engine, op->type, op->ratio,
+                               op->output_amplitude, op->modulation_amplitude);
+        waves_waveform_set_envelope(engine, handles[i], op->envelope);
+    }
+
+    for (int i = 0; i < patch->edge_count; i++) {
+        int to = patch->edges[i][1];
+        waves_connect_waveforms(engine, handles[patch->edges[i][0]],
+                                to == OUT ? WAVES_OUTPUT : handles[to]);
+    }
+
+    for (int i = 0; i < patch->route_count; i++) {
+        const BenchRoute *route = patch->routes + i;
+        waves_route(engine, route->source, handles[route->op],
+                    route->parameter, route->depth);
+    }
+
+    waves_compile(engine);
+    return engine;
+}
+
+static double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    const char *family;
+    BenchPatch patch;
+    int depth;
+    int fanout;
+    int polyphony;
+    WaveformType type;
+    // Render with the generic renderer only, see waves_set_kernels()
+    int generic;
+} BenchCase;
+
+// Returns the nanoseconds per frame taken.
+static double case_run(const BenchCase *bench_case, double seconds,
+                       size_t threads) {
+    WavesEngine *engine = patch_build(&bench_case->patch, threads);
+    waves_set_kernels(engine, !bench_case->generic);
+    waves_set_polyphony(engine, bench_case->polyphony);
+    for (int i = 0; i < bench_case->polyphony; i++)
+        waves_note_on(engine, 24 + i % 96, 100);
+
+    static float out[BLOCK_FRAMES];
+    // Warm up, and get past the attack
+    for (int i = 0; i < SAMPLE_RATE / 10; i += BLOCK_FRAMES)
+        waves_render_block(engine, out, BLOCK_FRAMES);
+
+    size_t frames = seconds * SAMPLE_RATE;
+    double start = seconds_now();
+    for (size_t i = 0; i < frames; i += BLOCK_FRAMES)
+        waves_render_block(engine, out, BLOCK_FRAMES);
+    double taken = seconds_now() - start;
+
+    double ns_per_frame = taken * 1e9 / frames;
+    double ns_per_voice_frame = ns_per_frame / bench_case->polyphony;
+    printf("{\"case\": \"%s\", \"operators\": %d, \"depth\": %d, "
+           "\"fanout\": %d, \"polyphony\": %d, \"waveform\": \"%s\", "
+           "\"threads\": %zu, \"kernels\": %s, \"ns_per_frame\": %.2f, "
+           "\"ns_per_voice_frame\": %.2f, \"voices_per_core\": %.1f}\n",
+           bench_case->family, bench_case->patch.op_count, bench_case->depth,
+           bench_case->fanout, bench_case->polyphony,
+           waveform_names[bench_case->type], threads,
+           bench_case->generic ? "false" : "true", ns_per_frame,
+           ns_per_voice_frame, 1e9 / SAMPLE_RATE / ns_per_voice_frame);
+    fflush(stdout);
+
+    waves_engine_destroy(engine);
+    return ns_per_frame;
+}
+
+static void matrix_run(double seconds, size_t threads) {
+    BenchCase bench_case;
+
+    int operator_counts[] = {1, 2, 4, 8, 16};
+    for (size_t i = 0; i < sizeof(operator_counts) / sizeof(int); i++) {
+        bench_case = (BenchCase){
+            .family = "operators",
+            .patch = patch_parallel(operator_counts[i]),
+            .depth = 1,
+            .fanout = 1,
+            .polyphony = 8,
+        };
+        case_run(&bench_case, seconds, threads);
+    }
+
+    int depths[] = {1, 2, 4, 8, 16};
+    for (size_t i = 0; i < sizeof(depths) / sizeof(int); i++) {
+        bench_case = (BenchCase){
+            .family = "depth",
+            .patch = patch_stack(depths[i], WAVES_WAVEFORM_SINE),
+            .depth = depths[i],
+            .fanout = 1,
+            .polyphony = 8,
+        };
+        case_run(&bench_case, seconds, threads);
+    }
+
+    int fanouts[] = {1, 2, 4, 8};
+    for (size_t i = 0; i < sizeof(fanouts) / sizeof(int); i++) {
+        bench_case = (BenchCase){
+            .family = "fanout",
+            .patch = patch_fanout(fanouts[i]),
+            .depth = 2,
+            .fanout = fanouts[i],
+            .polyphony = 8,
+        };
+        case_run(&bench_case, seconds, threads);
+    }
+
+    // Compiles to the same program as the fanout family
+    for (size_t i = 0; i < sizeof(fanouts) / sizeof(int); i++) {
+        bench_case = (BenchCase){
+            .family = "redundant",
+            .patch = patch_redundant(fanouts[i]),
+            .depth = 2,
+            .fanout = fanouts[i],
+            .polyphony = 8,
+        };
+        case_run(&bench_case, seconds, threads);
+    }
+
+    // Stacks whose first operator feeds back into itself, as in most FM
+    // patches, and stacks whose last operator feeds back into the first one
+    int feedback_depths[] = {2, 6};
+    for (int cycle = 0; cycle < 2; cycle++) {
+        for (size_t i = 0; i < sizeof(feedback_depths) / sizeof(int); i++) {
+            bench_case = (BenchCase){
+                .family = cycle ? "feedback_cycle" : "feedback",
+                .patch = patch_stack(feedback_depths[i], WAVES_WAVEFORM_SINE),
+                .depth = feedback_depths[i],
+                .fanout = 1,
+                .polyphony = 8,
+            };
+            patch_connect(&bench_case.patch,
+                          cycle ? feedback_depths[i] - 1 : 0, 0);
+            case_run(&bench_case, seconds, threads);
+        }
+    }
+
+    int polyphonies[] = {1, 8, 32, 64, 128};
+    for (size_t i = 0; i < sizeof(polyphonies) / sizeof(int); i++) {
+        bench_case = (BenchCase){
+            .family = "polyphony",
+            .patch = patch_stack(4, WAVES_WAVEFORM_SINE),
+            .depth = 4,
+            .fanout = 1,
+            .polyphony = polyphonies[i],
+        };
+        case_run(&bench_case, seconds, threads);
+    }
+
+    // Topologies with a specialized kernel, rendered with and without it
+    int kernels[][2] = {{1, 1}, {2, 1}, {4, 1}, {6, 1}, {8, 1}, {1, 2},
+                        {1, 3}, {1, 4}, {1, 6}, {2, 2}, {3, 2}, {2, 3}};
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+        double ns_per_frame[2];
+        for (int generic = 0; generic < 2; generic++) {
+            bench_case = (BenchCase){
+                .family = "kernel",
+                .patch = patch_stacks(kernels[i][0], kernels[i][1]),
+                .depth = kernels[i][1],
+                .fanout = 1,
+                .polyphony = 8,
+                .generic = generic,
+            };
+            ns_per_frame[generic] = case_run(&bench_case, seconds, threads);
+        }
+        printf("{\"kernel\": \"stacks_%dx%d\", \"speedup\": %.2f}\n",
+               kernels[i][0], kernels[i][1], ns_per_frame[1] / ns_per_frame[0]);
+    }
+
+    // Topologies without a kernel, rendered with voices in SIMD lanes and one
+    // voice at a time
+    struct {
+        const char *name;
+        BenchPatch patch;
+        int depth;
+        int fanout;
+        WaveformType type;
+    } lane_patches[] = {
+        {"fanout_4", patch_fanout(4), 2, 4, WAVES_WAVEFORM_SINE},
+        {"stack_8", patch_stack(8, WAVES_WAVEFORM_SINE), 8, 1,
+         WAVES_WAVEFORM_SINE},
+        {"saw_stack_2", patch_stack(2, WAVES_WAVEFORM_SAW), 2, 1,
+         WAVES_WAVEFORM_SAW},
+    };
+    int lane_polyphonies[] = {8, 128};
+    for (size_t i = 0; i < sizeof(lane_patches) / sizeof(*lane_patches);
+         i++) {
+        for (size_t j = 0; j < sizeof(lane_polyphonies) / sizeof(int); j++) {
+            double ns_per_frame[2];
+            for (int generic = 0; generic < 2; generic++) {
+                bench_case = (BenchCase){
+                    .family = "lanes",
+                    .patch = lane_patches[i].patch,
+                    .depth = lane_patches[i].depth,
+                    .fanout = lane_patches[i].fanout,
+                    .polyphony = lane_polyphonies[j],
+                    .type = lane_patches[i].type,
+                    .generic = generic,
+                };
+                ns_per_frame[generic] =
+                    case_run(&bench_case, seconds, threads);
+            }
+            printf("{\"lanes\": \"%s\", \"polyphony\": %d, "
+                   "\"speedup\": %.2f}\n",
+                   lane_patches[i].name, lane_polyphonies[j],
+                   ns_per_frame[1] / ns_per_frame[0]);
+        }
+    }
+
+    for (int type = WAVES_WAVEFORM_SINE; type <= WAVES_WAVEFORM_SQUARE;
+         type++) {
+        bench_case = (BenchCase){
+            .family = "waveform",
+            .patch = patch_stack(2, type),
+            .depth = 2,
+            .fanout = 1,
+            .polyphony = 8,
+            .type = type,
+        };
+        case_run(&bench_case, seconds, threads);
+    }
+}
+
+// Reference renderer, a direct double precision implementation of the
+// synthesis model, evaluating every operator of every voice one frame at a
+// time.
+
+typedef struct {
+    double phase;
+    double level;
+    double coef;
+    double base;
+    double target;
+    double output;
+    int stage;
+} ReferenceOp;
+
+enum { STAGE_ATTACK, STAGE_DECAY, STAGE_SUSTAIN, STAGE_RELEASE, STAGE_OFF };
+
+static void reference_segment(const Envelope *envelope, double from,
+                              double to, double seconds, ReferenceOp *op) {
+    double samples = fmax(seconds * SAMPLE_RATE, 1);
+    op->target = to;
+    if (envelope->curve == WAVES_CURVE_LINEAR) {
+        op->coef = 1;
+        op->base = (to - from) / samples;
+        return;
+    }
+
+    double overshoot = to > from ? 0.3 : 0.001;
+    op->coef = exp(-log((fabs(to - from) + overshoot) / overshoot) / samples);
+    op->base = (to > from ? to + overshoot : to - overshoot) * (1 - op->coef);
+}
+
+static void reference_enter(const Envelope *envelope, ReferenceOp *op,
+                            int stage) {
+    if (stage == STAGE_SUSTAIN && op->level <= 0)
+        stage = STAGE_OFF;
+    op->stage = stage;
+
+    if (stage == STAGE_ATTACK)
+        reference_segment(envelope, 0, 1, envelope->attack, op);
+    else if (stage == STAGE_DECAY)
+        reference_segment(envelope, 1, envelope->sustain, envelope->decay,
+                          op);
+    else if (stage == STAGE_RELEASE) {
+        reference_segment(envelope, 1, 0, envelope->release, op);
+        if (envelope->curve == WAVES_CURVE_LINEAR)
+            op->base *= op->level;
+    } else if (stage == STAGE_OFF)
+        op->level = 0;
+}
+
+static double reference_envelope(const Envelope *envelope, ReferenceOp *op) {
+    if (op->stage == STAGE_SUSTAIN || op->stage == STAGE_OFF)
+        return op->level;
+
+    op->level = op->level * op->coef + op->base;
+    int done = op->stage == STAGE_ATTACK ? op->level >= op->target
+                                         : op->level <= op->target;
+    if (done) {
+        op->level = op->target;
+        reference_enter(envelope, op, op->stage + 1);
+    }
+    return op->level;
+}
+
+// Returns the value `parameter` of operator `op` heads to at `frame` of a
+// note, its base value plus the values of the sources routed to it.
+static double reference_target(const BenchPatch *patch, int op, int note,
+                               WaveformParameter parameter, size_t frame) {
+    const BenchOp *bench_op = patch->ops + op;
+    double value = parameter == WAVES_PARAMETER_OUTPUT_AMPLITUDE
+                       ? bench_op->output_amplitude
+                   : parameter == WAVES_PARAMETER_MODULATION_AMPLITUDE
+                       ? bench_op->modulation_amplitude
+                       : bench_op->ratio;
+
+    for (int i = 0; i < patch->route_count; i++) {
+        const BenchRoute *route = patch->routes + i;
+        if (route->op != op || route->parameter != parameter)
+            continue;
+
+        double source = 0;
+        if (route->source == WAVES_SOURCE_VELOCITY)
+            source = GOLDEN_VELOCITY / 127.0;
+        else if (route->source == WAVES_SOURCE_KEY)
+            source = (note - 60) / 12.0;
+        else if (patch->macro_frame && frame >= patch->macro_frame)
+            source = patch->macro_value;
+        value += source * route->depth;
+    }
+    return value;
+}
+
+// Returns `parameter` of operator `op` at `frame` of a note. The target is
+// evaluated every WAVES_CONTROL_INTERVAL frames and approached linearly over
+// the next interval, starting from the target itself.
+static double reference_parameter(const BenchPatch *patch, int op, int note,
+                                  WaveformParameter parameter, size_t frame) {
+    size_t start = frame / WAVES_CONTROL_INTERVAL * WAVES_CONTROL_INTERVAL;
+    double to = reference_target(patch, op, note, parameter, start);
+    double from =
+        start ? reference_target(patch, op, note, parameter,
+                                 start - WAVES_CONTROL_INTERVAL)
+              : to;
+    return from +
+           (to - from) * (frame - start + 1) / WAVES_CONTROL_INTERVAL;
+}
+
+// The ideal band-limited waveform with as many harmonics as the engine's
+// wavetable level for the same frequency has.
+static double reference_wave(WaveformType type, double x, double step) {
+    if (type == WAVES_WAVEFORM_SINE)
+        return sin(2 * M_PI * x);
+
+    int exponent, level = 0;
+    frexp(step * 2048, &exponent);
+    if (exponent > 0)
+        level = exponent < 11 ? exponent : 10;
+
+    double sum = 0;
+    for (int h = 1; h <= 1024 >> level; h++) {
+        double s = sin(2 * M_PI * h * x);
+        if (type == WAVES_WAVEFORM_SAW)
+            sum += (h % 2 ? 2 : -2) / (M_PI * h) * s;
+        else if (type == WAVES_WAVEFORM_SQUARE && h % 2)
+            sum += 4 / (M_PI * h) * s;
+        else if (type == WAVES_WAVEFORM_TRIANGLE && h % 2)
+            sum += ((h / 2) % 2 ? -8 : 8) / (M_PI * M_PI * h * h) * s;
+    }
+    return sum;
+}
+
+static void reference_render(const BenchPatch *patch, const int *notes,
+                             int note_count, double *out, size_t frames,
+                             size_t release_frame) {
+    memset(out, 0, frames * sizeof(double));
+
+    for (int n = 0; n < note_count; n++) {
+        // Pitches are single precision in the engine, a difference in tuning
+        // rather than synthesis
+        float frequency = 440 * pow(2, (notes[n] - 69) / 12.0);
+        ReferenceOp ops[MAX_BENCH_OPS] = {0};
+        for (int i = 0; i < patch->op_count; i++)
+            reference_enter(&patch->ops[i].envelope, ops + i, STAGE_ATTACK);
+
+        for (size_t frame = 0; frame < frames; frame++) {
+            if (frame == release_frame)
+                for (int i = 0; i < patch->op_count; i++)
+                    if (ops[i].stage != STAGE_OFF)
+                        reference_enter(&patch->ops[i].envelope, ops + i,
+                                        STAGE_RELEASE);
+
+            // Values of the previous frame for feedback
+            double previous[MAX_BENCH_OPS];
+            for (int i = 0; i < patch->op_count; i++)
+                previous[i] = ops[i].output;
+
+            for (int i = 0; i < patch->op_count; i++) {
+                const BenchOp *op = patch->ops + i;
+                double modulation = 0;
+                for (int e = 0; e < patch->edge_count; e++) {
+                    int from = patch->edges[e][0];
+                    if (patch->edges[e][1] != i)
+                        continue;
+                    // Fed back with the amplitude of the frame it was
+                    // rendered in
+                    if (from >= i) {
+                        modulation +=
+                            previous[from] *
+                            reference_parameter(
+                                patch, from, notes[n],
+                                WAVES_PARAMETER_MODULATION_AMPLITUDE,
+                                frame ? frame - 1 : 0);
+                        continue;
+                    }
+                    modulation += ops[from].output *
+                                  reference_parameter(
+                                      patch, from, notes[n],
+                                      WAVES_PARAMETER_MODULATION_AMPLITUDE,
+                                      frame);
+                }
+
+                double ratio =
+                    reference_parameter(patch, i, notes[n],
+                                        WAVES_PARAMETER_FREQUENCY_RATIO, frame);
+                double step = (double)(frequency * (float)ratio) / SAMPLE_RATE;
+                double envelope = reference_envelope(&op->envelope, ops + i);
+                ops[i].phase += step;
+                ops[i].output =
+                    reference_wave(op->type,
+                                   ops[i].phase + modulation / (2 * M_PI),
+                                   step) *
+                    envelope;
+            }
+
+            for (int e = 0; e < patch->edge_count; e++) {
+                int from = patch->edges[e][0];
+                if (patch->edges[e][1] == OUT)
+                    out[frame] +=
+                        ops[from].output *
+                        reference_parameter(patch, from, notes[n],
+                                            WAVES_PARAMETER_OUTPUT_AMPLITUDE,
+                                            frame);
+            }
+        }
+    }
+}
+
+// Notes checked against the reference renderer, and their pans in stereo
+static const int golden_notes[] = {45, 64, 71};
+static const float golden_pans[] = {-1, 0.5, 0};
+#define GOLDEN_NOTE_COUNT (sizeof(golden_notes) / sizeof(*golden_notes))
+
+// Render threads the golden patches are also rendered with, expecting the
+// same output as with a single thread, and the number of notes played then,
+// enough for every thread to render voices
+static const size_t golden_threads[] = {2, 4};
+#define GOLDEN_THREADED_NOTE_COUNT 40
+
+// Renders `note_count` notes of `patch` panned by `pans` with the engine, to
+// `frames` frames of `channels` interleaved channels, with `threads` render
+// threads. The notes start at once with GOLDEN_VELOCITY and are released at
+// GOLDEN_RELEASE seconds.
+static void golden_render(const BenchPatch *patch, const int *notes,
+                          const float *pans, size_t note_count,
+                          size_t channels, size_t threads, float *out,
+                          size_t frames) {
+    WavesEngine *engine = patch_build(patch, threads);
+    waves_set_polyphony(engine, note_count);
+    for (size_t i = 0; i < note_count; i++) {
+        WavesEvent note_on = {
+            .type = WAVES_EVENT_NOTE_ON,
+            .note = notes[i],
+            .velocity = GOLDEN_VELOCITY,
+            .value = pans[i],
+        };
+        waves_send_event(engine, &note_on);
+    }
+    if (patch->macro_frame) {
+        WavesEvent macro = {
+            .time = patch->macro_frame,
+            .type = WAVES_EVENT_MACRO,
+            .source = MACRO,
+            .value = patch->macro_value,
+        };
+        waves_send_event(engine, &macro);
+    }
+    WavesEvent release = {
+        .time = GOLDEN_RELEASE * SAMPLE_RATE,
+        .type = WAVES_EVENT_ALL_NOTES_OFF,
+    };
+    waves_send_event(engine, &release);
+
+    for (size_t i = 0; i < frames; i += BLOCK_FRAMES) {
+        size_t count = frames - i < BLOCK_FRAMES ? frames - i : BLOCK_FRAMES;
+        waves_render_interleaved(engine, out + i * channels, channels,
+                                 count);
+    }
+    waves_engine_destroy(engine);
+}
+
+// Renders `patch` with the engine and the reference renderer and reports
+// the largest difference. The engine renders the notes both in mono and
+// panned in stereo, the reference pans every note on its own. The engine
+// also renders them with every count of golden_threads, which has to give
+// the same output bit for bit. Returns 0 if the difference is above the
+// tolerance or the output depends on the number of threads.
+static int golden_run(const BenchPatch *patch) {
+    size_t frames = GOLDEN_SECONDS * SAMPLE_RATE;
+    size_t release_frame = GOLDEN_RELEASE * SAMPLE_RATE;
+
+    // Mono output followed by interleaved stereo output
+    float *out = malloc(3 * frames * sizeof(float));
+    float *single = malloc(2 * frames * sizeof(float));
+    float *threaded = malloc(2 * frames * sizeof(float));
+    double *reference = calloc(3 * frames, sizeof(double));
+    double *note = malloc(frames * sizeof(double));
+    if (!out || !single || !threaded || !reference || !note)
+        abort();
+
+    int threaded_notes[GOLDEN_THREADED_NOTE_COUNT];
+    float threaded_pans[GOLDEN_THREADED_NOTE_COUNT];
+    for (int i = 0; i < GOLDEN_THREADED_NOTE_COUNT; i++) {
+        threaded_notes[i] = 36 + i;
+        threaded_pans[i] = 2.0f * i / (GOLDEN_THREADED_NOTE_COUNT - 1) - 1;
+    }
+
+    int threads_identical = 1;
+    for (size_t channels = 1; channels <= 2; channels++) {
+        golden_render(patch, golden_notes, golden_pans, GOLDEN_NOTE_COUNT,
+                      channels, 1, out + (channels - 1) * frames, frames);
+
+        golden_render(patch, threaded_notes, threaded_pans,
+                      GOLDEN_THREADED_NOTE_COUNT, channels, 1, single,
+                      frames);
+        for (size_t i = 0;
+             i < sizeof(golden_threads) / sizeof(*golden_threads); i++) {
+            golden_render(patch, threaded_notes, threaded_pans,
+                          GOLDEN_THREADED_NOTE_COUNT, channels,
+                          golden_threads[i], threaded, frames);
+            threads_identical &=
+                !memcmp(threaded, single, channels * frames * sizeof(float));
+        }
+    }
+
+    for (size_t n = 0; n < GOLDEN_NOTE_COUNT; n++) {
+        reference_render(patch, golden_notes + n, 1, note, frames,
+                         release_frame);
+        float pan = golden_pans[n];
+        double left = pan > 0 ? 1 - pan : 1;
+        double right = pan < 0 ? 1 + pan : 1;
+        for (size_t i = 0; i < frames; i++) {
+            reference[i] += note[i];
+            reference[frames + 2 * i] += note[i] * left;
+            reference[frames + 2 * i + 1] += note[i] * right;
+        }
+    }
+
+    double max_error = 0;
+    size_t max_error_frame = 0;
+    for (size_t i = 0; i < 3 * frames; i++) {
+        double error = fabs(out[i] - reference[i]);
+        if (error > max_error) {
+            max_error = error;
+            max_error_frame = i < frames ? i : (i - frames) / 2;
+        }
+    }
+
+    int pass = max_error <= GOLDEN_TOLERANCE && threads_identical;
+    printf("{\"golden\": \"%s\", \"max_error\": %.3g, \"frame\": %zu, "
+           "\"tolerance\": %.3g, \"threads_identical\": %s, "
+           "\"pass\": %s}\n",
+           patch->name, max_error, max_error_frame, GOLDEN_TOLERANCE,
+           threads_identical ? "true" : "false", pass ? "true" : "false");
+
+    free(out);
+    free(single);
+    free(threaded);
+    free(reference);
+    free(note);
+    return pass;
+}
+
+static int golden_run_all(void) {
+    int pass = 1;
+    BenchPatch patch;
+
+    patch = patch_stack(3, WAVES_WAVEFORM_SINE);
+    patch.name = "sine_stack";
+    patch.ops[0].envelope = (Envelope){0.05, 0.2, 0.3, 0.2, WAVES_CURVE_LINEAR};
+    patch.ops[2].envelope = (Envelope){0.02, 0.1, 0.7, 0.3, WAVES_CURVE_LINEAR};
+    pass &= golden_run(&patch);
+
+    patch = patch_fanout(3);
+    patch.name = "fanout_exponential";
+    for (int i = 0; i < patch.op_count; i++)
+        patch.ops[i].envelope =
+            (Envelope){0.03, 0.2, 0.5, 0.25, WAVES_CURVE_EXPONENTIAL};
+    pass &= golden_run(&patch);
+
+    patch = patch_stack(2, WAVES_WAVEFORM_SINE);
+    patch.name = "feedback";
+    patch.ops[0].modulation_amplitude = 0.8;
+    patch_connect(&patch, 0, 0);
+    pass &= golden_run(&patch);
+
+    for (int type = WAVES_WAVEFORM_TRIANGLE; type <= WAVES_WAVEFORM_SQUARE;
+         type++) {
+        patch = patch_parallel(1);
+        patch.ops[0].type = type;
+        patch.ops[0].envelope =
+            (Envelope){0.01, 0.1, 0.5, 0.1, WAVES_CURVE_LINEAR};
+        patch.name = waveform_names[type];
+        pass &= golden_run(&patch);
+    }
+
+    // Merged modulators, muted modulators and a modulator that falls silent
+    // before the release
+    patch = patch_redundant(3);
+    patch.name = "redundant";
+    patch.ops[1].modulation_amplitude = 2.0;
+    patch.ops[1].envelope = (Envelope){0.01, 0.2, 0, 0.1, WAVES_CURVE_LINEAR};
+    pass &= golden_run(&patch);
+
+    patch = patch_stack(2, WAVES_WAVEFORM_SAW);
+    patch.name = "saw_fm";
+    patch.ops[0].modulation_amplitude = 0.5;
+    pass &= golden_run(&patch);
+
+    // Control-rate ramps of every parameter, a macro moving mid-note between
+    // two control intervals, and feedback through a routed amplitude
+    patch = patch_stack(2, WAVES_WAVEFORM_SINE);
+    patch.name = "routes";
+    patch.ops[0].modulation_amplitude = 0.3;
+    patch_connect(&patch, 0, 0);
+    patch_route(&patch, MACRO, 0, WAVES_PARAMETER_MODULATION_AMPLITUDE, 0.5);
+    patch_route(&patch, MACRO, 1, WAVES_PARAMETER_FREQUENCY_RATIO, 0.5);
+    patch_route(&patch, WAVES_SOURCE_VELOCITY, 1,
+                WAVES_PARAMETER_OUTPUT_AMPLITUDE, 0.3);
+    patch_route(&patch, WAVES_SOURCE_KEY, 0, WAVES_PARAMETER_FREQUENCY_RATIO,
+                0.25);
+    patch.macro_frame = 0.25 * SAMPLE_RATE + 5;
+    patch.macro_value = 1;
+    pass &= golden_run(&patch);
+
+    return pass;
+}
+
+int main(int argc, char **argv) {
+    double seconds = DEFAULT_SECONDS;
+    size_t threads = 1;
+    int golden_only = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:t:g")) != -1) {
+        switch (option) {
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'g':
+            golden_only = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: bench [-s seconds] [-t threads] [-g]\n");
+            return 2;
+        }
+    }
+
+    if (seconds <= 0 || threads > WAVES_MAX_RENDER_THREADS) {
+        fprintf(stderr, "usage: bench [-s seconds] [-t threads] [-g]\n");
+        return 2;
+    }
+
+    if (!golden_only)
+        matrix_run(seconds, threads);
+
+    return golden_run_all() ? 0 : 1;
+}
@@ -1,62 +1,97 @@
 #include "miniaudio.h"
 #include "waves.h"
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #define DEVICE_FORMAT ma_format_f32
 #define DEVICE_CHANNELS 2
 #define DEVICE_SAMPLE_RATE 48000
 
+static WavesEngine *engine = 0;
+static atomic_int quit = 0;
+
 void data_callback(ma_device *pDevice, void *pOutput, const void *pInput,
                    ma_uint32 frameCount) {
-    float *frames_out = (float *)pOutput;
-    for (uint32_t i_frame = 0; i_frame < frameCount; i_frame += 1) {
+    // The only interaction with waves in this function, renders panned
+    // stereo frames straight into the device's interleaved buffer
+    waves_render_interleaved(engine, (float *)pOutput,
+                             pDevice->playback.channels, frameCount);
 
-        // The only interaction with waves in this function
-        float value = waves_get_frame();
+    (void)pInput;
+}
+
+// Plays `note` panned by `pan`, from -1 (left) to 1 (right).
+void note_on_panned(uint8_t note, float pan) {
+    waves_send_event(engine, &(WavesEvent){
+                                 .type = WAVES_EVENT_NOTE_ON,
+                                 .note = note,
+                                 .velocity = 1,
+                                 .value = pan,
+                             });
+}
 
-        for (uint32_t i_channel = 0; i_channel < pDevice->playback.channels;
-             i_channel += 1) {
-            frames_out[i_frame * pDevice->playback.channels + i_channel] =
-                value;
+// Prints the engine's rendering statistics once a second.
+void *stats_main(void *arg) {
+    while (!atomic_load(&quit)) {
+        sleep(1);
+        WavesStats stats;
+        if (!waves_get_stats(engine, &stats)) {
+            printf("built without WAVES_STATS\n");
+            return 0;
         }
+        printf("load %5.1f%%  block avg %6.1f us  max %6.1f us  "
+               "voices %2llu  stolen %llu  overruns %llu\n",
+               stats.load, stats.block_time_avg * 1e6,
+               stats.block_time_max * 1e6,
+               (unsigned long long)stats.active_voices,
+               (unsigned long long)stats.stolen_voices,
+               (unsigned long long)stats.overruns);
     }
-
-    (void)pInput;
+    (void)arg;
+    return 0;
 }
 
 int main(int argc, char **argv) {
-    waves_init(DEVICE_SAMPLE_RATE);
+    engine = waves_engine_create(DEVICE_SAMPLE_RATE);
 
     WaveformHandle carrier =
-        waves_new_waveform(WAVES_WAVEFORM_SINE, 1.0, 0.2, 0);
-
-    WaveformHandle m1 = waves_new_waveform(WAVES_WAVEFORM_SINE, 1.5, 0, 0.2);
-    WaveformHandle m2 = waves_new_waveform(WAVES_WAVEFORM_SINE, 0.5, 0, 6.0);
-
-    waves_connect_waveforms(m1, carrier);
-    waves_connect_waveforms(m2, carrier);
-    waves_connect_waveforms(carrier, WAVES_OUTPUT);
-
-    waves_waveform_set_envelope(carrier, (Envelope){
-                                             .attack = 1.0,
-                                             .sustain = 0.6,
-                                             .decay = 0.6,
-                                             .release = 1.0,
-                                         });
-    waves_waveform_set_envelope(m1, (Envelope){
-                                        .attack = 0.1,
-                                        .sustain = 0.4,
-                                        .decay = 0.3,
-                                        .release = 0.4,
-                                    });
-    waves_waveform_set_envelope(m2, (Envelope){
-                                        .attack = 0.1,
-                                        .sustain = 0.2,
-                                        .decay = 0.5,
-                                        .release = 0.4,
-                                    });
+        waves_new_waveform(engine, WAVES_WAVEFORM_SINE, 1.0, 0.2, 0);
+
+    WaveformHandle m1 =
+        waves_new_waveform(engine, WAVES_WAVEFORM_SINE, 1.5, 0, 0.2);
+    WaveformHandle m2 =
+        waves_new_waveform(engine, WAVES_WAVEFORM_SINE, 0.5, 0, 6.0);
+
+    waves_connect_waveforms(engine, m1, carrier);
+    waves_connect_waveforms(engine, m2, carrier);
+    waves_connect_waveforms(engine, carrier, WAVES_OUTPUT);
+
+    waves_waveform_set_envelope(engine, carrier,
+                                (Envelope){
+                                    .attack = 1.0,
+                                    .sustain = 0.6,
+                                    .decay = 0.6,
+                                    .release = 1.0,
+                                });
+    waves_waveform_set_envelope(engine, m1,
+                                (Envelope){
+                                    .attack = 0.1,
+                                    .sustain = 0.4,
+                                    .decay = 0.3,
+                                    .release = 0.4,
+                                });
+    waves_waveform_set_envelope(engine, m2,
+                                (Envelope){
+                                    .attack = 0.1,
+                                    .sustain = 0.2,
+                                    .decay = 0.5,
+                                    .release = 0.4,
+                                });
 
     ma_device_config deviceConfig;
     ma_device device;
@@ -80,22 +115,31 @@ int main(int argc, char **argv) {
         return -5;
     }
 
+    // Run with -s to print rendering statistics while playing
+    pthread_t stats_thread;
+    int print_stats = argc > 1 && !strcmp(argv[1], "-s");
+    if (print_stats)
+        pthread_create(&stats_thread, 0, stats_main, 0);
+
     printf("q+enter to quit\n");
     printf("enter to toggle notes on and off\n");
     while (1) {
-        waves_note_on(55, 1);
-        waves_note_on(62, 1);
+        note_on_panned(55, -0.5);
+        note_on_panned(62, 0.5);
         if (getchar() == 'q')
             break;
-        waves_note_off(55);
-        waves_note_off(62);
+        waves_note_off(engine, 55);
+        waves_note_off(engine, 62);
         if (getchar() == 'q')
             break;
     }
 
     ma_device_uninit(&device);
+    if (print_stats) {
+        atomic_store(&quit, 1);
+        pthread_join(stats_thread, 0);
+    }
+    waves_engine_destroy(engine);
 
-    (void)argc;
-    (void)argv;
     return 0;
 }
@@ -1,9 +1,6 @@
 #ifndef _WAVES
 #define _WAVES
 
-//  TODO: Envelopes
-//  TODO: Free parameters, input macros
-
 /*
    (c) Tatu Laras 2025
 
@@ -23,8 +20,37 @@
 // audible.
 #define WAVES_OUTPUT 1
 
+// Maximum number of waveforms reachable from the output waveform.
+#define WAVES_MAX_OPERATORS 64
+
+// Size of the voice pool, the upper limit for waves_set_polyphony().
+#define WAVES_MAX_VOICES 128
+#define WAVES_DEFAULT_POLYPHONY 32
+
+// Upper limit for waves_set_render_threads().
+#define WAVES_MAX_RENDER_THREADS 16
+
+// Capacity of the event queue between the control and audio threads.
+#define WAVES_EVENT_QUEUE_SIZE 1024
+
+// Modulation sources are evaluated, and routed parameters ramped linearly to
+// their new values, once per this many frames.
+#define WAVES_CONTROL_INTERVAL 32
+
+// Upper limit for the number of modulation sources, built-in ones included.
+#define WAVES_MAX_SOURCES 32
+#define WAVES_MAX_SOURCE_NAME 32
+
 typedef size_t WaveformHandle;
-VEC_DECLARE(WaveformHandle, WaveformHandleVec, wfhandlevec)
+
+// A control rate value routed to waveform parameters with waves_route().
+// Handle 0 is a null handle, the sources below are built in and the rest are
+// macros created with waves_new_macro().
+typedef size_t WavesSource;
+// Velocity of the note, from 0 to 1
+#define WAVES_SOURCE_VELOCITY 1
+// Distance of the note from middle C in octaves
+#define WAVES_SOURCE_KEY 2
 
 typedef enum {
     WAVES_WAVEFORM_SINE,
@@ -34,11 +60,20 @@ typedef enum {
     WAVES_WAVEFORM_OUTPUT,
 } WaveformType;
 
+typedef enum {
+    WAVES_CURVE_LINEAR,
+    // Attack approaches its peak like a charging capacitor, decay and release
+    // fall off exponentially.
+    WAVES_CURVE_EXPONENTIAL,
+} EnvelopeCurve;
+
+// Attack, decay and release are in seconds, sustain is a level in [0, 1].
 typedef struct {
     float attack;
     float decay;
     float sustain;
     float release;
+    EnvelopeCurve curve;
 } Envelope;
 
 typedef struct {
@@ -46,46 +81,277 @@ typedef struct {
     float modulation_amplitude;
     float frequency_ratio;
     WaveformType type;
-    WaveformHandleVec inputs;
     Envelope envelope;
 } Waveform;
 
+// A modulation or output connection made with waves_connect_waveforms().
+typedef struct {
+    WaveformHandle from;
+    WaveformHandle to;
+} WaveformConnection;
+
+typedef enum {
+    // Replace the oldest voice, preferring voices that have been released
+    WAVES_STEAL_OLDEST,
+    // Replace the voice with the lowest output level
+    WAVES_STEAL_QUIETEST,
+    // Retrigger a voice already playing the same note, otherwise steal the
+    // oldest voice
+    WAVES_STEAL_SAME_NOTE,
+} WavesStealPolicy;
+
+typedef enum {
+    WAVES_PARAMETER_OUTPUT_AMPLITUDE,
+    WAVES_PARAMETER_MODULATION_AMPLITUDE,
+    WAVES_PARAMETER_FREQUENCY_RATIO,
+} WaveformParameter;
+
+// A route made with waves_route().
+typedef struct {
+    WavesSource source;
+    WaveformHandle waveform;
+    WaveformParameter parameter;
+    float depth;
+} WavesRoute;
+
+typedef enum {
+    WAVES_EVENT_NOTE_ON,
+    WAVES_EVENT_NOTE_OFF,
+    WAVES_EVENT_ALL_NOTES_OFF,
+    // Sets `parameter` of waveform `waveform` to `value`
+    WAVES_EVENT_PARAMETER,
+    // Sets macro `source` to `value`
+    WAVES_EVENT_MACRO,
+    // Sets the gain applied to the output to `value`, see waves_set_gain()
+    WAVES_EVENT_GAIN,
+    // Sets the polyphony to `value` voices, see waves_set_polyphony()
+    WAVES_EVENT_POLYPHONY,
+    // Sets the steal policy to `steal_policy`
+    WAVES_EVENT_STEAL_POLICY,
+} WavesEventType;
+
 typedef struct {
-    float press_time;
-    float release_time;
-    float frequency;
+    // Frame at which the event takes effect, as counted by waves_get_time().
+    // Events in the past, such as 0, take effect at the start of the next
+    // rendered block.
+    uint64_t time;
+    WavesEventType type;
+    uint8_t note;
     uint8_t velocity;
-    uint8_t active;
-} Note;
+    WaveformHandle waveform;
+    WaveformParameter parameter;
+    WavesSource source;
+    // For WAVES_EVENT_NOTE_ON, the pan of the voice from -1 (left) to 1
+    // (right), see waves_render_interleaved()
+    float value;
+    WavesStealPolicy steal_policy;
+} WavesEvent;
+
+// DSP load histogram bin `n` counts blocks taking 10n% to 10(n + 1)% of
+// their real-time budget, the last bin counts every block above that.
+#define WAVES_STATS_HISTOGRAM_BINS 12
+
+// Rendering statistics, see waves_get_stats(). A block is a single call to
+// waves_render_block(), its budget is the duration of the frames it renders.
+typedef struct {
+    uint64_t blocks;
+    // Wall clock render time per block in seconds
+    double block_time_min;
+    double block_time_avg;
+    double block_time_max;
+    // Render time of the last block as a percentage of its budget
+    double load;
+    uint64_t load_histogram[WAVES_STATS_HISTOGRAM_BINS];
+    // Blocks that took longer than their budget
+    uint64_t overruns;
+    uint64_t active_voices;
+    // Voices replaced by new notes because the polyphony was reached, since
+    // the engine was created
+    uint64_t stolen_voices;
+} WavesStats;
 
 VEC_DECLARE(Waveform, WaveformVec, wfvec)
+VEC_DECLARE(WaveformConnection, WaveformConnectionVec, wfconnvec)
+VEC_DECLARE(WavesRoute, WavesRouteVec, wfroutevec)
 
-// Initializes the library, call this before any other function.
-void waves_init(float sample_rate);
+// A single synth instance. Engines share no mutable state, so separate
+// engines can be used from separate threads.
+typedef struct WavesEngine WavesEngine;
+
+// Creates a new engine, call this before any other function.
+WavesEngine *waves_engine_create(float sample_rate);
+// Frees the engine and everything associated with it.
+void waves_engine_destroy(WavesEngine *engine);
 
 // Create a new waveform. Will not affect anything unless connected with
 // waves_connect_waveforms().
 // `output_amplitude` and `modulation_amplitude` will be the wave's amplitude if
 // connected to the audible output waveform or another waveform for modulation
 // (a carrier), respectively.
-WaveformHandle waves_new_waveform(WaveformType type, float frequency_ratio,
+WaveformHandle waves_new_waveform(WavesEngine *engine, WaveformType type,
+                                  float frequency_ratio,
                                   float output_amplitude,
                                   float modulation_amplitude);
 
-void waves_waveform_set_envelope(WaveformHandle handle, Envelope envelope);
+void waves_waveform_set_envelope(WavesEngine *engine, WaveformHandle handle,
+                                 Envelope envelope);
 
 // Connects waveform `from` to modulate waveform `to`.
 // Modulation amount depends on the modulation_amplitude of the waveform `from`.
 // A waveform can be made audible by connecting it to the output waveform, the
 // handle of which is the constant WAVES_OUTPUT.
-void waves_connect_waveforms(WaveformHandle from, WaveformHandle to);
+// Connections forming a cycle are allowed, the waveform closing the cycle is
+// read with a one sample delay (feedback).
+void waves_connect_waveforms(WavesEngine *engine, WaveformHandle from,
+                             WaveformHandle to);
+
+// Compiles the waveform graph into a flat program in which every waveform
+// reachable from the output is evaluated at most once per frame, and hands it
+// to the audio thread, which switches to it at the start of its next block
+// without allocating or locking. Sounding voices carry on with the waveforms
+// that are still in the graph.
+// Connections whose amplitude is 0 and not routed are left out, and waveforms
+// computing the same signal as another (same type, frequency ratio, envelope
+// and inputs, no routes or feedback) are evaluated once and shared. While
+// rendering, waveforms whose envelope has finished are skipped.
+// The graph is only ever read by the thread editing it, edits are not heard
+// until this is called. Called automatically by waves_send_event() and the
+// functions built on it after the graph has been edited.
+// Returns 0 if more than WAVES_MAX_OPERATORS waveforms are reachable from the
+// output, in which case the previous program is kept until the graph is
+// edited and compiled again, 1 otherwise.
+int waves_compile(WavesEngine *engine);
+
+// Creates a new macro named `name`, a modulation source set with
+// waves_set_macro() that starts at 0. Like graph edits, routes from it take
+// effect after compiling.
+WavesSource waves_new_macro(WavesEngine *engine, const char *name);
+// Returns the source named `name`, "velocity", "key" or a macro, or 0 if
+// there is none.
+WavesSource waves_find_source(WavesEngine *engine, const char *name);
+
+// Adds `depth` times the value of `source` to `parameter` of `waveform`,
+// evaluated separately for every voice. The value set with
+// waves_waveform_set_parameter() is the base routes are added to.
+void waves_route(WavesEngine *engine, WavesSource source,
+                 WaveformHandle waveform, WaveformParameter parameter,
+                 float depth);
+
+// A set of compiled patches loaded from a file, see waves_bank_load().
+typedef struct WavesBank WavesBank;
+
+// Saves the graphs of `engines` as a bank of `count` patches, in order. A
+// bank of one patch is a patch file. The format stores compiled programs
+// as they are laid out in memory, so it is only portable between machines
+// of the same byte order and type sizes, and version of this library.
+// Returns 0 if the file could not be written, or a patch has waveform handles
+// above 65535 or more than WAVES_MAX_OPERATORS reachable waveforms, 1
+// otherwise.
+int waves_bank_save(const char *path, WavesEngine *const *engines,
+                    size_t count);
+// Maps the bank at `path` into memory, patches are used in place without
+// being parsed or copied. Returns 0 if the file cannot be read or is not a
+// valid bank of this version.
+WavesBank *waves_bank_load(const char *path);
+// Unmaps the bank, no engine may be using any of its patches.
+void waves_bank_free(WavesBank *bank);
+size_t waves_bank_patch_count(const WavesBank *bank);
+
+// Switches `engine` to patch `index` of `bank`, replacing its graph and
+// macros with the patch's. Waveform and macro handles are the ones the patch
+// had when it was saved, waveforms that did not affect the output are not
+// saved. Sounding voices carry on like after waves_compile().
+// The audio thread renders the patch from the bank without copying it, and
+// nothing is allocated once the graph has grown to the size of the largest
+// patch, unless the bank was saved at another sample rate and the patch has
+// to be compiled again.
+void waves_bank_select(WavesEngine *engine, const WavesBank *bank,
+                       size_t index);
 
-void waves_note_on(uint8_t note, uint8_t velocity);
-void waves_note_off(uint8_t note);
-void waves_all_notes_off(void);
+// Sets the maximum number of simultaneously sounding voices, voices above the
+// limit are cut. Like the event functions below, takes effect at the start
+// of the next rendered block and returns 0 if the event queue is full.
+int waves_set_polyphony(WavesEngine *engine, size_t voice_count);
+// Sets how a voice is chosen to be replaced when a note is played while all
+// voices are in use. Defaults to WAVES_STEAL_OLDEST. Takes effect like
+// waves_set_polyphony().
+int waves_set_steal_policy(WavesEngine *engine, WavesStealPolicy policy);
+
+// Programs of common topologies, such as a stack of sine waveforms or sine
+// waveforms in parallel, are rendered by specialized kernels instead of the
+// generic renderer. Other programs without feedback or parameter routes are
+// rendered several voices at a time, one voice per SIMD lane. Output is the
+// same up to rounding. Disabling the kernels forces the generic renderer, one
+// voice at a time, for comparing the two. Enabled by default.
+void waves_set_kernels(WavesEngine *engine, int enabled);
+
+// Spreads the voices of every block over `thread_count` threads, the thread
+// calling waves_render_block() included. 0 or 1 renders on the calling
+// thread only, which is the default. Output is bit-identical regardless of
+// the number of threads.
+// Must not be called while a block is being rendered.
+void waves_set_render_threads(WavesEngine *engine, size_t thread_count);
+
+// Queues `event` to be applied by the audio thread at its exact frame.
+// Events are applied in the order they are sent, so their times should not
+// decrease. The queue is lock-free, but has a single producer: all event
+// functions must be called from the same thread.
+// Returns 0 if the queue is full and the event was dropped, 1 otherwise.
+int waves_send_event(WavesEngine *engine, const WavesEvent *event);
+
+// Returns the number of frames rendered so far, for timing events.
+uint64_t waves_get_time(WavesEngine *engine);
+
+// Shorthands for waves_send_event() with events taking effect at the start
+// of the next rendered block.
+
+// Starts a new centered voice playing `note`, stealing one if the polyphony
+// limit has been reached.
+int waves_note_on(WavesEngine *engine, uint8_t note, uint8_t velocity);
+// Releases every voice playing `note`.
+int waves_note_off(WavesEngine *engine, uint8_t note);
+int waves_all_notes_off(WavesEngine *engine);
+// Changes a parameter of a waveform that may be sounding. Changes that undo
+// an optimization of waves_compile(), making a muted connection audible or
+// the frequency ratio of a shared waveform differ, compile the graph again
+// and take effect at the start of the next block. Waveforms brought back
+// into the program this way start their envelopes over.
+int waves_waveform_set_parameter(WavesEngine *engine, WaveformHandle handle,
+                                 WaveformParameter parameter, float value);
+// Sets the value of a macro, parameters it is routed to move to their new
+// values over WAVES_CONTROL_INTERVAL frames.
+int waves_set_macro(WavesEngine *engine, WavesSource macro, float value);
+// Sets the gain every output channel is multiplied by, which moves to its new
+// value over WAVES_CONTROL_INTERVAL frames. Defaults to 1.
+int waves_set_gain(WavesEngine *engine, float gain);
+
+// Copies the latest rendering statistics to `stats`. Never blocks the audio
+// thread and can be called from any thread.
+// Statistics are only gathered when waves.c is compiled with WAVES_STATS
+// defined, otherwise `stats` is zeroed and 0 is returned, 1 otherwise.
+int waves_get_stats(WavesEngine *engine, WavesStats *stats);
+
+// Synthezises `frames` float32 mono pcm frames into `out`, using the waveform
+// configuration created using waves_new_waveform() and
+// waves_connect_waveforms().
+// Call this once per audio callback with the whole buffer, per-voice and
+// per-waveform work is done once per block instead of once per frame.
+// Voices are not panned in mono output.
+void waves_render_block(WavesEngine *engine, float *out, size_t frames);
 
-// Synthezises a single float32 mono pcm frame, using the waveform configuration
-// created using waves_new_waveform() and waves_connect_waveforms().
-float waves_get_frame(void);
+// Like waves_render_block(), but renders `channel_count` channels straight
+// into the interleaved buffer `out`, `channel_count` samples per frame, such
+// as the buffer of an audio device.
+// The first two channels are the left and right channels, the rest are
+// silent. Every voice is panned by the pan of the note that started it: a
+// centered voice is at full level in both channels, a voice panned to one
+// side fades out of the other one. A single channel is the mono output of
+// waves_render_block().
+void waves_render_interleaved(WavesEngine *engine, float *out,
+                              size_t channel_count, size_t frames);
+// Like waves_render_interleaved(), but writes channel `c` to the separate
+// buffer `out[c]`.
+void waves_render_planar(WavesEngine *engine, float *const *out,
+                         size_t channel_count, size_t frames);
 
 #endif
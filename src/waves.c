@@ -1,197 +1,2983 @@
 #include "waves.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-VEC_IMPLEMENT(Waveform, WaveformVec, wfvec)
-VEC_IMPLEMENT(WaveformHandle, WaveformHandleVec, wfhandlevec)
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Width of the vectors the renderers work with, see Lanes
+#if defined(__AVX2__) && defined(__FMA__)
+#define LANES 8
+#elif defined(__SSE4_1__)
+#define LANES 4
+#else
+#define LANES 1
+#endif
 
-static WaveformVec waveforms = {0};
-static float waveform_sample_rate = 0;
-static float max_release = 0;
-static double time = 0;
+#ifdef WAVES_STATS
+#include <time.h>
+#endif
+
+VEC_IMPLEMENT(Waveform, WaveformVec, wfvec)
+VEC_IMPLEMENT(WaveformConnection, WaveformConnectionVec, wfconnvec)
+VEC_IMPLEMENT(WavesRoute, WavesRouteVec, wfroutevec)
 
 #define MIDI_NOTE_COUNT 128
-static Note notes[MIDI_NOTE_COUNT] = {0};
+// Internal processing block size, larger requests are rendered in chunks.
+#define WAVES_BLOCK_SIZE 256
+
+typedef enum {
+    ENVELOPE_ATTACK,
+    ENVELOPE_DECAY,
+    ENVELOPE_SUSTAIN,
+    ENVELOPE_RELEASE,
+    ENVELOPE_OFF,
+} EnvelopeStage;
+
+// An envelope stage as the per-sample recurrence level = level * coef + base,
+// which ends when the level reaches `target`. A `coef` of 1 is a linear ramp.
+typedef struct {
+    float coef;
+    float base;
+    float target;
+} EnvelopeSegment;
+
+typedef struct {
+    // Operator index of the input, always smaller than the index of the
+    // operator reading it unless `feedback` is set.
+    uint32_t source;
+    // Input closes a cycle and is read with a one sample delay.
+    uint8_t feedback;
+} OperatorInput;
+
+// A route of a compiled program, see waves_route().
+typedef struct {
+    uint32_t source;
+    uint32_t parameter;
+    float depth;
+} OperatorRoute;
+
+// The waveform graph flattened into topological order, one operator per
+// waveform reachable from the output, which is always the last operator.
+// A program is a single allocation: this header followed by one array per
+// operator field. Arrays are addressed by byte offsets from the header, so
+// that a program can be copied and moved as is. Once handed to the audio
+// thread, a program is only accessed by it until it is retired.
+typedef struct Program {
+    // Size of the whole program in bytes
+    uint32_t size;
+    uint32_t operator_count;
+    uint32_t input_count;
+    uint32_t route_count;
+    uint32_t source_count;
+    uint32_t has_feedback;
+    uint32_t flags;
+    // Index into `kernels` of the renderer for the program, see
+    // kernel_match()
+    uint32_t kernel;
+    // Sample rate the envelope segments were computed for
+    float sample_rate;
+    struct {
+        uint32_t handles;               // uint32_t
+        uint32_t types;                 // uint8_t, WaveformType
+        uint32_t frequency_ratios;      // float
+        uint32_t output_amplitudes;     // float
+        uint32_t modulation_amplitudes; // float
+        uint32_t envelopes;             // Envelope
+        uint32_t attacks;               // EnvelopeSegment
+        uint32_t decays;                // EnvelopeSegment
+        // Linear release is stored for a drop from 1, and scaled by the level
+        // at which the release starts.
+        uint32_t releases; // EnvelopeSegment
+        // Inputs of operator `i` are inputs[inputs_starts[i]] onwards
+        uint32_t inputs_starts; // uint32_t
+        uint32_t inputs_counts; // uint32_t
+        uint32_t inputs;        // OperatorInput
+        // Operator whose output is the output of operator `i`: `i` itself,
+        // or an earlier operator computing the same output, in which case
+        // operator `i` is not rendered
+        uint32_t merged_into; // uint32_t
+        // Bit `parameter` is set if any route modulates it
+        uint32_t routed; // uint8_t
+        // Routes of operator `i` are routes[routes_starts[i]] onwards
+        uint32_t routes_starts; // uint32_t
+        uint32_t routes_counts; // uint32_t
+        uint32_t routes;        // OperatorRoute
+        // Names of the modulation sources, indexed by WavesSource
+        uint32_t source_names; // char[WAVES_MAX_SOURCE_NAME]
+    } offsets;
+    // Next program in WavesEngine.retired_programs
+    struct Program *next_retired;
+} Program;
+
+// Returns a pointer to array `field` of `program`, see Program.offsets.
+#define PROGRAM_ARRAY(program, field)                                          \
+    ((void *)((char *)(program) + (program)->offsets.field))
+
+// Alignment of the arrays of a program
+#define PROGRAM_ALIGNMENT 64
+
+// Program.flags
+// Part of a WavesBank, read-only and never freed by an engine
+#define PROGRAM_IN_BANK 1
+
+// Set in WavesEngine.pending_program when the graph has been replaced since
+// the program rendered by the audio thread was compiled, see program_swap()
+#define PENDING_NEW_GRAPH 1
+
+// Number of WaveformParameter values
+#define PARAMETER_COUNT 3
+
+// Per-note state of a single operator.
+typedef struct {
+    // Oscillator phase in turns, wrapped to [0, 1) after every block.
+    double phase;
+    float last_output;
+    EnvelopeStage envelope_stage;
+    float envelope_level;
+    // Current envelope segment, see EnvelopeSegment
+    float envelope_coef;
+    float envelope_base;
+    float envelope_target;
+    // Ramps of routed parameters, see control_render()
+    float control_values[PARAMETER_COUNT];
+    float control_steps[PARAMETER_COUNT];
+    float control_targets[PARAMETER_COUNT];
+    uint8_t control_remaining[PARAMETER_COUNT];
+    // Bit `parameter` is set once its ramp has started
+    uint8_t control_started;
+} OperatorState;
+
+// A single sounding note. Several voices can play the same note.
+typedef struct {
+    float frequency;
+    // Peak absolute output of the last rendered block, used for stealing
+    float loudness;
+    uint8_t note;
+    uint8_t velocity;
+    uint8_t released;
+    // Gains of the left and right channels, see voice_note_on()
+    float pan_gains[2];
+    OperatorState operators[WAVES_MAX_OPERATORS];
+} Voice;
 
-void waves_init(float sample_rate) {
+// Active voices are rendered in groups of consecutive voices. Every group is
+// mixed on its own and the group mixes are summed in order, so the output
+// does not depend on which thread rendered which group. A group fills the
+// lanes of a vector, see lanes_render().
+#define VOICE_GROUP_SIZE (LANES > 4 ? LANES : 4)
+#define VOICE_GROUP_COUNT (WAVES_MAX_VOICES / VOICE_GROUP_SIZE)
+
+// Scratch memory of a single rendering thread.
+typedef struct {
+    // Unscaled output of each operator for the block being rendered.
+    float operator_buffers[WAVES_MAX_OPERATORS][WAVES_BLOCK_SIZE];
+    // Output and modulation amplitudes of operators whose amplitudes are
+    // routed, indexed by WaveformParameter
+    float amplitude_buffers[WAVES_MAX_OPERATORS][2][WAVES_BLOCK_SIZE];
+} RenderScratch;
+
+typedef struct {
+    WavesEngine *engine;
+    pthread_t thread;
+    // Posted once for every block the worker should help render
+    sem_t start;
+    RenderScratch scratch;
+} RenderWorker;
+
+// All state of a single synth, nothing is shared between engines.
+struct WavesEngine {
+    // The graph, only accessed by the control thread
+    WaveformVec waveforms;
+    WaveformConnectionVec connections;
+    WavesRouteVec routes;
+    char source_names[WAVES_MAX_SOURCES][WAVES_MAX_SOURCE_NAME];
+    size_t source_count;
+    int program_dirty;
+    // Set when the graph is replaced, until the next program is published
+    int graph_replaced;
+    float sample_rate;
+
+    // Last program handed to the audio thread. Only programs it replaced are
+    // freed, so the control thread can keep reading it.
+    const Program *published;
+
+    // Program rendered by the audio thread
+    Program *program;
+    // Parameters of the operators of `program`, indexed by WaveformParameter
+    // and changed by parameter events, which leaves programs read-only
+    float parameters[PARAMETER_COUNT][WAVES_MAX_OPERATORS];
+    // Values of the macros, indexed by WavesSource
+    float source_values[WAVES_MAX_SOURCES];
+    // Compiled program not yet picked up by the audio thread, or'ed with
+    // PENDING_NEW_GRAPH, which programs are aligned to leave room for
+    _Atomic(uintptr_t) pending_program;
+    // Programs replaced by the audio thread, to be freed by the control
+    // thread
+    _Atomic(Program *) retired_programs;
+
+    Voice voices[WAVES_MAX_VOICES];
+    // Indices of sounding voices into `voices`, oldest first
+    uint16_t active_voices[WAVES_MAX_VOICES];
+    size_t active_voice_count;
+    uint16_t free_voices[WAVES_MAX_VOICES];
+    size_t free_voice_count;
+    size_t polyphony;
+    WavesStealPolicy steal_policy;
+
+    // Single-producer single-consumer ring buffer of pending events, written
+    // by the control thread and drained by the audio thread
+    WavesEvent events[WAVES_EVENT_QUEUE_SIZE];
+    atomic_size_t events_written;
+    atomic_size_t events_read;
+    // Number of frames rendered so far
+    atomic_uint_least64_t time;
+
+    // Gain applied to the output, approaching `gain_target` linearly over
+    // WAVES_CONTROL_INTERVAL frames after a gain event
+    float gain;
+    float gain_step;
+    float gain_target;
+    size_t gain_remaining;
+
+    RenderScratch scratch;
+    float group_mixes[VOICE_GROUP_COUNT][2][WAVES_BLOCK_SIZE];
+
+    // The block being rendered, see waves_render_block()
+    size_t job_frames;
+    // Channels of the group mixes, 1 for unpanned mono output or 2 for
+    // stereo output
+    size_t job_channels;
+    size_t job_group_count;
+    atomic_size_t next_group;
+    atomic_size_t busy_workers;
+    atomic_int workers_quit;
+    RenderWorker *workers;
+    size_t worker_count;
+    // Render every program with program_render(), see waves_set_kernels()
+    atomic_int kernels_disabled;
+
+#ifdef WAVES_STATS
+    // Written by the audio thread only
+    WavesStats stats;
+    double stats_time_total;
+    // Seqlock publishing `stats` to readers, odd while being written. The
+    // words are atomic so that a torn read is a retry rather than a race.
+    atomic_uint stats_sequence;
+    atomic_uint_least64_t stats_words[sizeof(WavesStats) / sizeof(uint64_t)];
+#endif
+};
+
+static void workers_stop(WavesEngine *engine);
+static void wavetables_init(void);
+static Program *program_build(const WavesEngine *engine);
+static void program_free(Program *program);
+static void programs_reclaim(WavesEngine *engine);
+static void parameters_load(WavesEngine *engine);
+static uint32_t kernel_match(const Program *program);
+
+WavesEngine *waves_engine_create(float sample_rate) {
     assert(sample_rate);
 
-    waveforms = wfvec_init();
-    assert(waveforms.data);
+    wavetables_init();
+
+    WavesEngine *engine = calloc(1, sizeof(WavesEngine));
+    assert(engine);
+
+    engine->waveforms = wfvec_init();
+    engine->connections = wfconnvec_init();
+    engine->routes = wfroutevec_init();
+    assert(engine->waveforms.data && engine->connections.data &&
+           engine->routes.data);
 
     // Handle 0 will be a null handle
-    wfvec_append(&waveforms, (Waveform){0});
+    wfvec_append(&engine->waveforms, (Waveform){0});
     // Handle 1 will be the output node
-    wfvec_append(&waveforms, (Waveform){
-                                 .type = WAVES_WAVEFORM_OUTPUT,
-                                 .inputs = wfhandlevec_init(),
-                             });
+    wfvec_append(&engine->waveforms, (Waveform){
+                                         .type = WAVES_WAVEFORM_OUTPUT,
+                                     });
 
-    waveform_sample_rate = sample_rate;
+    // Source 0 is a null handle, the built-in sources follow
+    strcpy(engine->source_names[WAVES_SOURCE_VELOCITY], "velocity");
+    strcpy(engine->source_names[WAVES_SOURCE_KEY], "key");
+    engine->source_count = WAVES_SOURCE_KEY + 1;
 
-    for (uint8_t i = 0; i < MIDI_NOTE_COUNT; i++) {
-        notes[i].frequency = 440.0 * pow(2, (float)(i - 69) / 12);
-    }
+    engine->sample_rate = sample_rate;
+    engine->program = program_build(engine);
+    engine->published = engine->program;
+    parameters_load(engine);
+    engine->polyphony = WAVES_DEFAULT_POLYPHONY;
+    engine->steal_policy = WAVES_STEAL_OLDEST;
+    engine->gain = 1;
+    engine->gain_target = 1;
+
+    for (size_t i = 0; i < WAVES_MAX_VOICES; i++)
+        engine->free_voices[i] = WAVES_MAX_VOICES - 1 - i;
+    engine->free_voice_count = WAVES_MAX_VOICES;
+
+    return engine;
+}
+
+void waves_engine_destroy(WavesEngine *engine) {
+    if (!engine)
+        return;
+
+    workers_stop(engine);
+
+    wfvec_free(&engine->waveforms);
+    wfconnvec_free(&engine->connections);
+    wfroutevec_free(&engine->routes);
+
+    programs_reclaim(engine);
+    program_free((Program *)(atomic_load(&engine->pending_program) &
+                             ~(uintptr_t)PENDING_NEW_GRAPH));
+    program_free(engine->program);
+    free(engine);
 }
 
-WaveformHandle waves_new_waveform(WaveformType type, float frequency_ratio,
+WaveformHandle waves_new_waveform(WavesEngine *engine, WaveformType type,
+                                  float frequency_ratio,
                                   float output_amplitude,
                                   float modulation_amplitude) {
-    assert(waveforms.data);
-    assert(waveform_sample_rate);
+    assert(engine);
 
-    return wfvec_append(&waveforms,
+    return wfvec_append(&engine->waveforms,
 
                         (Waveform){
                             .output_amplitude = output_amplitude,
                             .modulation_amplitude = modulation_amplitude,
                             .type = type,
                             .frequency_ratio = frequency_ratio,
-                            .inputs = wfhandlevec_init(),
                             .envelope = {.sustain = 1.0},
                         });
 }
 
-void waves_waveform_set_envelope(WaveformHandle handle, Envelope envelope) {
+void waves_waveform_set_envelope(WavesEngine *engine, WaveformHandle handle,
+                                 Envelope envelope) {
+    assert(engine);
     assert(handle);
-    assert(waveforms.data);
 
-    Waveform *wf = wfvec_get(&waveforms, handle);
+    Waveform *wf = wfvec_get(&engine->waveforms, handle);
     assert(wf);
 
     wf->envelope = envelope;
-    max_release = fmax(max_release, envelope.release);
+    engine->program_dirty = 1;
 }
 
-void waves_connect_waveforms(WaveformHandle from, WaveformHandle to) {
+void waves_connect_waveforms(WavesEngine *engine, WaveformHandle from,
+                             WaveformHandle to) {
+    assert(engine);
     assert(from);
-    assert(waveforms.data);
     assert(to);
 
-    Waveform *wf = wfvec_get(&waveforms, to);
-    assert(wf);
-    assert(wf->inputs.data);
+    assert(from < engine->waveforms.data_used);
+    assert(to < engine->waveforms.data_used);
+
+    wfconnvec_append(&engine->connections, (WaveformConnection){
+                                               .from = from,
+                                               .to = to,
+                                           });
+    engine->program_dirty = 1;
+}
+
+WavesSource waves_new_macro(WavesEngine *engine, const char *name) {
+    assert(engine);
+    assert(name);
+    assert(strlen(name) < WAVES_MAX_SOURCE_NAME);
+    assert(!waves_find_source(engine, name));
+
+    if (engine->source_count >= WAVES_MAX_SOURCES) {
+        fprintf(stderr, "ERROR: More than %u modulation sources.\n",
+                WAVES_MAX_SOURCES);
+        abort();
+    }
+
+    WavesSource source = engine->source_count++;
+    strcpy(engine->source_names[source], name);
+    return source;
+}
+
+WavesSource waves_find_source(WavesEngine *engine, const char *name) {
+    assert(engine);
+    assert(name);
+
+    for (WavesSource i = 1; i < engine->source_count; i++)
+        if (!strcmp(engine->source_names[i], name))
+            return i;
+    return 0;
+}
+
+void waves_route(WavesEngine *engine, WavesSource source,
+                 WaveformHandle waveform, WaveformParameter parameter,
+                 float depth) {
+    assert(engine);
+    assert(source && source < engine->source_count);
+    assert(waveform && waveform != WAVES_OUTPUT &&
+           waveform < engine->waveforms.data_used);
+    assert(parameter < PARAMETER_COUNT);
+
+    wfroutevec_append(&engine->routes, (WavesRoute){
+                                           .source = source,
+                                           .waveform = waveform,
+                                           .parameter = parameter,
+                                           .depth = depth,
+                                       });
+    engine->program_dirty = 1;
+}
+
+// Overshoot of the exponential curves' targets, smaller values give more
+// strongly curved segments.
+#define ENVELOPE_ATTACK_OVERSHOOT 0.3f
+#define ENVELOPE_DECAY_OVERSHOOT 0.001f
+
+// Returns the segment moving the level from `from` to `to` in `seconds`.
+static EnvelopeSegment envelope_segment(float from, float to, float seconds,
+                                        EnvelopeCurve curve,
+                                        float sample_rate) {
+    float samples = fmaxf(seconds * sample_rate, 1);
+
+    if (curve == WAVES_CURVE_LINEAR)
+        return (EnvelopeSegment){
+            .coef = 1,
+            .base = (to - from) / samples,
+            .target = to,
+        };
+
+    // Approach a target past `to` exponentially, so that `to` is reached in
+    // finite time
+    float overshoot =
+        to > from ? ENVELOPE_ATTACK_OVERSHOOT : ENVELOPE_DECAY_OVERSHOOT;
+    float coef = expf(-logf((fabsf(to - from) + overshoot) / overshoot) /
+                      samples);
+    float overshot_target = to > from ? to + overshoot : to - overshoot;
+    return (EnvelopeSegment){
+        .coef = coef,
+        .base = overshot_target * (1 - coef),
+        .target = to,
+    };
+}
+
+// Moves the envelope of operator `index` to `stage`, starting from its
+// current level.
+static void envelope_enter(const Program *program, size_t index,
+                           OperatorState *state, EnvelopeStage stage) {
+    if (stage == ENVELOPE_SUSTAIN && state->envelope_level <= 0)
+        stage = ENVELOPE_OFF;
+    state->envelope_stage = stage;
+
+    const EnvelopeSegment *segment = 0;
+    switch (stage) {
+    case ENVELOPE_ATTACK:
+        segment = (EnvelopeSegment *)PROGRAM_ARRAY(program, attacks) + index;
+        break;
+    case ENVELOPE_DECAY:
+        segment = (EnvelopeSegment *)PROGRAM_ARRAY(program, decays) + index;
+        break;
+    case ENVELOPE_RELEASE:
+        segment = (EnvelopeSegment *)PROGRAM_ARRAY(program, releases) + index;
+        break;
+    case ENVELOPE_SUSTAIN:
+        return;
+    case ENVELOPE_OFF:
+        state->envelope_level = 0;
+        return;
+    }
+
+    state->envelope_coef = segment->coef;
+    state->envelope_base = segment->base;
+    state->envelope_target = segment->target;
+    if (stage == ENVELOPE_RELEASE && segment->coef == 1)
+        state->envelope_base *= state->envelope_level;
+}
+
+// Advances the envelope of operator `index` by `frames` samples, writing the
+// level after every sample to `out`.
+static void envelope_render(const Program *program, size_t index,
+                            OperatorState *state, float *out, size_t frames) {
+    size_t k = 0;
+    while (k < frames) {
+        EnvelopeStage stage = state->envelope_stage;
+        if (stage == ENVELOPE_SUSTAIN || stage == ENVELOPE_OFF) {
+            for (; k < frames; k++)
+                out[k] = state->envelope_level;
+            return;
+        }
+
+        float level = state->envelope_level;
+        float coef = state->envelope_coef;
+        float base = state->envelope_base;
+        float target = state->envelope_target;
+        int rising = stage == ENVELOPE_ATTACK;
+        int done = 0;
+        while (k < frames && !done) {
+            level = level * coef + base;
+            done = rising ? level >= target : level <= target;
+            out[k++] = done ? target : level;
+        }
+
+        state->envelope_level = done ? target : level;
+        if (done)
+            envelope_enter(program, index, state, stage + 1);
+    }
+}
+
+// Starts all operators of `voice` from the beginning of their envelopes.
+static void voice_start(const Program *program, Voice *voice) {
+    memset(voice->operators, 0, sizeof(voice->operators));
+    for (size_t i = 0; i < program->operator_count; i++)
+        envelope_enter(program, i, voice->operators + i, ENVELOPE_ATTACK);
+}
+
+// Starts the release stage of every operator of `voice`.
+static void voice_release(const Program *program, Voice *voice) {
+    voice->released = 1;
+    for (size_t i = 0; i < program->operator_count; i++) {
+        OperatorState *state = voice->operators + i;
+        if (state->envelope_stage != ENVELOPE_OFF)
+            envelope_enter(program, i, state, ENVELOPE_RELEASE);
+    }
+}
 
-    wfhandlevec_append(&wf->inputs, from);
+// Returns whether the envelopes of all operators connected to the output
+// have finished.
+static int voice_is_silent(const Program *program, Voice *voice) {
+    const uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    const uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    const OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    const uint32_t *merged_into = PROGRAM_ARRAY(program, merged_into);
+
+    size_t output = program->operator_count - 1;
+    for (size_t i = 0; i < inputs_counts[output]; i++) {
+        const OperatorInput *input = inputs + inputs_starts[output] + i;
+        const OperatorState *state =
+            voice->operators + merged_into[input->source];
+        if (state->envelope_stage != ENVELOPE_OFF)
+            return 0;
+    }
+    return 1;
+}
+
+// Moves the operator states of `voice` from program `from` to program `to`.
+// `sources` holds the index in `from` of every operator of `to`, or
+// UINT32_MAX for operators new to the program, which start their envelope
+// unless the voice has been released.
+static void voice_remap(const Program *to, const uint32_t *sources,
+                        Voice *voice) {
+    OperatorState states[WAVES_MAX_OPERATORS];
+    for (size_t i = 0; i < to->operator_count; i++) {
+        if (sources[i] != UINT32_MAX) {
+            states[i] = voice->operators[sources[i]];
+            continue;
+        }
+
+        states[i] = (OperatorState){0};
+        envelope_enter(to, i, states + i,
+                       voice->released ? ENVELOPE_OFF : ENVELOPE_ATTACK);
+    }
+    memcpy(voice->operators, states, to->operator_count * sizeof(*states));
 }
 
-static inline float decay(Envelope *envelope, float time_since_press) {
-    float decay_amount =
-        (time_since_press - envelope->attack) / envelope->decay;
-    decay_amount = decay_amount > 1.0 ? 1.0 : decay_amount;
-    return 1.0 - (1.0 - envelope->sustain) * decay_amount;
+// Returns a pointer to the parameter of waveform `wf`.
+#define WAVEFORM_PARAMETER(wf, parameter)                                      \
+    ((parameter) == WAVES_PARAMETER_OUTPUT_AMPLITUDE ? &(wf)->output_amplitude \
+     : (parameter) == WAVES_PARAMETER_MODULATION_AMPLITUDE                     \
+         ? &(wf)->modulation_amplitude                                         \
+         : &(wf)->frequency_ratio)
+
+enum { NODE_UNVISITED, NODE_VISITING, NODE_DONE };
+
+// Returns whether the connection from `from` to `to` scales its input by a
+// constant 0, in which case it is left out of the program along with the
+// waveforms only it reaches.
+static int connection_silent(const WavesEngine *engine, WaveformHandle from,
+                             WaveformHandle to) {
+    const Waveform *wf = engine->waveforms.data + from;
+    WaveformParameter parameter =
+        engine->waveforms.data[to].type == WAVES_WAVEFORM_OUTPUT
+            ? WAVES_PARAMETER_OUTPUT_AMPLITUDE
+            : WAVES_PARAMETER_MODULATION_AMPLITUDE;
+    if (*WAVEFORM_PARAMETER(wf, parameter) != 0)
+        return 0;
+
+    for (size_t i = 0; i < engine->routes.data_used; i++) {
+        const WavesRoute *route = engine->routes.data + i;
+        if (route->waveform == from && route->parameter == parameter)
+            return 0;
+    }
+    return 1;
 }
 
-static inline float release_multiplier(Envelope *envelope, Note *note) {
-    float time_since_press = time - note->press_time;
-    float time_since_release = time - note->release_time;
+// The connections of the graph grouped by destination, the inputs of
+// waveform `handle` are handles[starts[handle]] up to handles[starts[handle
+// + 1]], in the order they were connected. Silent connections are left out,
+// see connection_silent().
+typedef struct {
+    size_t *starts;
+    WaveformHandle *handles;
+} GraphInputs;
+
+static GraphInputs graph_inputs(const WavesEngine *engine) {
+    size_t waveform_count = engine->waveforms.data_used;
+    const WaveformConnectionVec *connections = &engine->connections;
+
+    GraphInputs inputs = {
+        .starts = calloc(waveform_count + 1, sizeof(size_t)),
+        .handles = malloc((connections->data_used + 1) *
+                          sizeof(WaveformHandle)),
+    };
+    assert(inputs.starts && inputs.handles);
+
+    uint8_t *silent = malloc(connections->data_used + 1);
+    assert(silent);
+    for (size_t i = 0; i < connections->data_used; i++) {
+        const WaveformConnection *connection = connections->data + i;
+        silent[i] = connection_silent(engine, connection->from, connection->to);
+        if (!silent[i])
+            inputs.starts[connection->to + 1]++;
+    }
+    for (size_t i = 0; i < waveform_count; i++)
+        inputs.starts[i + 1] += inputs.starts[i];
 
-    float current_level = envelope->sustain;
-    if (time_since_press < envelope->attack) {
-        current_level = time_since_press / envelope->attack;
-    } else if (time_since_press < envelope->attack + envelope->decay) {
-        current_level = decay(envelope, time_since_press);
+    // Place every connection at the cursor of its destination, which leaves
+    // starts[handle] at the end of the inputs of `handle`
+    for (size_t i = 0; i < connections->data_used; i++) {
+        const WaveformConnection *connection = connections->data + i;
+        if (!silent[i])
+            inputs.handles[inputs.starts[connection->to]++] = connection->from;
     }
+    free(silent);
+    for (size_t i = waveform_count; i > 0; i--)
+        inputs.starts[i] = inputs.starts[i - 1];
+    inputs.starts[0] = 0;
 
-    if (time_since_release >= max_release) {
-        note->active = 0;
+    return inputs;
+}
+
+// Depth-first post-order walk of the inputs of `handle`, appending every
+// waveform to `order` after all of its inputs. Inputs that lead back to a
+// waveform still being visited close a cycle and are not followed.
+// `visited` counts the waveforms reached so far, the walk stops once there
+// are more than WAVES_MAX_OPERATORS. Returns 0 if it stopped, 1 otherwise.
+static int program_visit(const GraphInputs *inputs, WaveformHandle handle,
+                         uint8_t *node_states, WaveformHandle *order,
+                         size_t *order_count, size_t *visited) {
+    if (++*visited > WAVES_MAX_OPERATORS)
         return 0;
+    node_states[handle] = NODE_VISITING;
+
+    for (size_t i = inputs->starts[handle]; i < inputs->starts[handle + 1];
+         i++) {
+        WaveformHandle input = inputs->handles[i];
+        if (node_states[input] == NODE_UNVISITED &&
+            !program_visit(inputs, input, node_states, order, order_count,
+                           visited))
+            return 0;
     }
 
-    float release_amount =
-        fmax(0.0, 1.0 - time_since_release / envelope->release);
-    return current_level * release_amount;
+    node_states[handle] = NODE_DONE;
+    order[(*order_count)++] = handle;
+    return 1;
 }
 
-static inline float calculate_envelope_multiplier(Envelope *envelope,
-                                                  Note *note) {
-    if (note->release_time > note->press_time)
-        return release_multiplier(envelope, note);
+// Reserves `count` elements of `element_size` bytes at the end of a program
+// of `size` bytes. Returns the offset of the reserved array.
+static uint32_t program_reserve(size_t *size, size_t count,
+                                size_t element_size) {
+    size_t offset =
+        (*size + PROGRAM_ALIGNMENT - 1) / PROGRAM_ALIGNMENT * PROGRAM_ALIGNMENT;
+    *size = offset + count * element_size;
+    return offset;
+}
 
-    float time_since_press = time - note->press_time;
+// Returns whether operators `a` and `b` of `program` always compute the same
+// output: they have the same waveform, frequency ratio, envelope and inputs,
+// and no routes or feedback that could tell them apart. Amplitudes only
+// scale the output where it is read, so they may differ.
+static int program_duplicates(const Program *program, size_t a, size_t b) {
+    const uint8_t *types = PROGRAM_ARRAY(program, types);
+    const float *frequency_ratios = PROGRAM_ARRAY(program, frequency_ratios);
+    const Envelope *envelopes = PROGRAM_ARRAY(program, envelopes);
+    const uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    const uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    const OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    const uint32_t *routes_counts = PROGRAM_ARRAY(program, routes_counts);
 
-    if (time_since_press < envelope->attack)
-        return time_since_press / envelope->attack;
+    const Envelope *ea = envelopes + a;
+    const Envelope *eb = envelopes + b;
+    if (types[a] != types[b] || types[a] == WAVES_WAVEFORM_OUTPUT ||
+        frequency_ratios[a] != frequency_ratios[b] ||
+        ea->attack != eb->attack || ea->decay != eb->decay ||
+        ea->sustain != eb->sustain || ea->release != eb->release ||
+        ea->curve != eb->curve || routes_counts[a] || routes_counts[b] ||
+        inputs_counts[a] != inputs_counts[b])
+        return 0;
 
-    return decay(envelope, time_since_press);
+    for (size_t i = 0; i < inputs_counts[a]; i++) {
+        const OperatorInput *ia = inputs + inputs_starts[a] + i;
+        const OperatorInput *ib = inputs + inputs_starts[b] + i;
+        if (ia->feedback || ib->feedback || ia->source != ib->source)
+            return 0;
+    }
+    return 1;
 }
 
-static float waveform_get_frame(WaveformHandle handle, Note *note,
-                                int use_output_amplitude) {
-    assert(waveforms.data);
-    assert(handle);
+// Compiles the graph of `engine` into a new program, leaving out silent
+// connections and merging duplicate operators. Returns 0 if more than
+// WAVES_MAX_OPERATORS waveforms are reachable from the output.
+static Program *program_build(const WavesEngine *engine) {
+    const WaveformVec *waveforms = &engine->waveforms;
+    size_t waveform_count = waveforms->data_used;
+    GraphInputs graph = graph_inputs(engine);
+    uint8_t *node_states = calloc(waveform_count, sizeof(uint8_t));
+    uint32_t *slots = malloc(waveform_count * sizeof(uint32_t));
+    assert(node_states && slots);
 
-    Waveform *wf = wfvec_get(&waveforms, handle);
-    assert(wf);
+    WaveformHandle order[WAVES_MAX_OPERATORS];
+    size_t operator_count = 0;
+    size_t visited = 0;
+    if (!program_visit(&graph, WAVES_OUTPUT, node_states, order,
+                       &operator_count, &visited)) {
+        free(graph.starts);
+        free(graph.handles);
+        free(node_states);
+        free(slots);
+        return 0;
+    }
 
-    float modulation = 0;
-    for (size_t i = 0; i < wf->inputs.data_used; i++) {
-        WaveformHandle *input_handle = wfhandlevec_get(&wf->inputs, i);
-        assert(input_handle);
-        modulation += waveform_get_frame(*input_handle, note,
-                                         wf->type == WAVES_WAVEFORM_OUTPUT);
+    size_t input_count = 0;
+    for (size_t i = 0; i < operator_count; i++) {
+        slots[order[i]] = i;
+        input_count += graph.starts[order[i] + 1] - graph.starts[order[i]];
     }
 
-    float output_amplitude = 0;
-    float wf_amplitude =
-        use_output_amplitude ? wf->output_amplitude : wf->modulation_amplitude;
+    // Routes to waveforms that are not part of the program are dropped
+    const WavesRouteVec *routes = &engine->routes;
+    size_t route_count = 0;
+    for (size_t i = 0; i < routes->data_used; i++)
+        for (size_t j = 0; j < operator_count; j++)
+            route_count += routes->data[i].waveform == order[j];
 
-    wf_amplitude *= calculate_envelope_multiplier(&wf->envelope, note);
+    Program layout = {
+        .operator_count = operator_count,
+        .input_count = input_count,
+        .route_count = route_count,
+        .source_count = engine->source_count,
+        .sample_rate = engine->sample_rate,
+    };
+    size_t size = sizeof(Program);
+    size_t n = operator_count;
+    layout.offsets.handles = program_reserve(&size, n, sizeof(uint32_t));
+    layout.offsets.types = program_reserve(&size, n, sizeof(uint8_t));
+    layout.offsets.frequency_ratios =
+        program_reserve(&size, n, sizeof(float));
+    layout.offsets.output_amplitudes =
+        program_reserve(&size, n, sizeof(float));
+    layout.offsets.modulation_amplitudes =
+        program_reserve(&size, n, sizeof(float));
+    layout.offsets.envelopes = program_reserve(&size, n, sizeof(Envelope));
+    layout.offsets.attacks =
+        program_reserve(&size, n, sizeof(EnvelopeSegment));
+    layout.offsets.decays =
+        program_reserve(&size, n, sizeof(EnvelopeSegment));
+    layout.offsets.releases =
+        program_reserve(&size, n, sizeof(EnvelopeSegment));
+    layout.offsets.inputs_starts = program_reserve(&size, n, sizeof(uint32_t));
+    layout.offsets.inputs_counts = program_reserve(&size, n, sizeof(uint32_t));
+    layout.offsets.inputs =
+        program_reserve(&size, input_count, sizeof(OperatorInput));
+    layout.offsets.merged_into = program_reserve(&size, n, sizeof(uint32_t));
+    layout.offsets.routed = program_reserve(&size, n, sizeof(uint8_t));
+    layout.offsets.routes_starts = program_reserve(&size, n, sizeof(uint32_t));
+    layout.offsets.routes_counts = program_reserve(&size, n, sizeof(uint32_t));
+    layout.offsets.routes =
+        program_reserve(&size, route_count, sizeof(OperatorRoute));
+    layout.offsets.source_names = program_reserve(
+        &size, engine->source_count, WAVES_MAX_SOURCE_NAME);
+    layout.size = size;
 
-    switch (wf->type) {
-    case WAVES_WAVEFORM_OUTPUT:
-        output_amplitude = modulation;
-        break;
-    case WAVES_WAVEFORM_SINE:
-        output_amplitude =
-            sin(time * 2 * M_PI * note->frequency * wf->frequency_ratio +
-                modulation) *
-            wf_amplitude;
-        break;
+    Program *program = aligned_alloc(
+        PROGRAM_ALIGNMENT,
+        (size + PROGRAM_ALIGNMENT - 1) / PROGRAM_ALIGNMENT * PROGRAM_ALIGNMENT);
+    assert(program);
+    memset(program, 0, size);
+    *program = layout;
 
-    case WAVES_WAVEFORM_TRIANGLE:
-    case WAVES_WAVEFORM_SAW:
-    case WAVES_WAVEFORM_SQUARE:
-        fprintf(stderr, "ERROR: Trying to play unsupported waveform type %u.\n",
-                wf->type);
-        abort();
+    uint32_t *handles = PROGRAM_ARRAY(program, handles);
+    uint8_t *types = PROGRAM_ARRAY(program, types);
+    float *frequency_ratios = PROGRAM_ARRAY(program, frequency_ratios);
+    float *output_amplitudes = PROGRAM_ARRAY(program, output_amplitudes);
+    float *modulation_amplitudes =
+        PROGRAM_ARRAY(program, modulation_amplitudes);
+    Envelope *envelopes = PROGRAM_ARRAY(program, envelopes);
+    EnvelopeSegment *attacks = PROGRAM_ARRAY(program, attacks);
+    EnvelopeSegment *decays = PROGRAM_ARRAY(program, decays);
+    EnvelopeSegment *releases = PROGRAM_ARRAY(program, releases);
+    uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    uint32_t *merged_into = PROGRAM_ARRAY(program, merged_into);
+    uint8_t *routed = PROGRAM_ARRAY(program, routed);
+    uint32_t *routes_starts = PROGRAM_ARRAY(program, routes_starts);
+    uint32_t *routes_counts = PROGRAM_ARRAY(program, routes_counts);
+    OperatorRoute *program_routes = PROGRAM_ARRAY(program, routes);
+
+    memcpy(PROGRAM_ARRAY(program, source_names), engine->source_names,
+           engine->source_count * WAVES_MAX_SOURCE_NAME);
+
+    float sample_rate = engine->sample_rate;
+    size_t input_index = 0;
+    size_t route_index = 0;
+    for (size_t i = 0; i < operator_count; i++) {
+        const Waveform *wf = waveforms->data + order[i];
+        const Envelope *envelope = &wf->envelope;
+        handles[i] = order[i];
+        types[i] = wf->type;
+        frequency_ratios[i] = wf->frequency_ratio;
+        output_amplitudes[i] = wf->output_amplitude;
+        modulation_amplitudes[i] = wf->modulation_amplitude;
+        envelopes[i] = *envelope;
+        attacks[i] = envelope_segment(0, 1, envelope->attack, envelope->curve,
+                                      sample_rate);
+        decays[i] = envelope_segment(1, envelope->sustain, envelope->decay,
+                                     envelope->curve, sample_rate);
+        releases[i] = envelope_segment(1, 0, envelope->release,
+                                       envelope->curve, sample_rate);
+        inputs_starts[i] = input_index;
+        inputs_counts[i] =
+            graph.starts[order[i] + 1] - graph.starts[order[i]];
+
+        for (size_t j = graph.starts[order[i]]; j < graph.starts[order[i] + 1];
+             j++) {
+            uint32_t source = slots[graph.handles[j]];
+            uint8_t feedback = source >= i;
+            inputs[input_index++] = (OperatorInput){
+                .source = source,
+                .feedback = feedback,
+            };
+            program->has_feedback |= feedback;
+        }
+
+        routes_starts[i] = route_index;
+        for (size_t j = 0; j < routes->data_used; j++) {
+            const WavesRoute *route = routes->data + j;
+            if (route->waveform != order[i])
+                continue;
+
+            program_routes[route_index++] = (OperatorRoute){
+                .source = route->source,
+                .parameter = route->parameter,
+                .depth = route->depth,
+            };
+            routed[i] |= 1 << route->parameter;
+        }
+        routes_counts[i] = route_index - routes_starts[i];
+
+        merged_into[i] = i;
+        for (size_t j = 0; j < i && merged_into[i] == i; j++)
+            if (merged_into[j] == j && program_duplicates(program, j, i))
+                merged_into[i] = j;
+    }
+    program->kernel = kernel_match(program);
+
+    free(graph.starts);
+    free(graph.handles);
+    free(node_states);
+    free(slots);
+    return program;
+}
+
+// Returns the array of `program` holding `parameter` of every operator.
+static const float *program_parameter(const Program *program,
+                                      WaveformParameter parameter) {
+    switch (parameter) {
+    case WAVES_PARAMETER_OUTPUT_AMPLITUDE:
+        return PROGRAM_ARRAY(program, output_amplitudes);
+    case WAVES_PARAMETER_MODULATION_AMPLITUDE:
+        return PROGRAM_ARRAY(program, modulation_amplitudes);
+    case WAVES_PARAMETER_FREQUENCY_RATIO:
         break;
     }
+    return PROGRAM_ARRAY(program, frequency_ratios);
+}
+
+// Frees `program` unless it belongs to a bank.
+static void program_free(Program *program) {
+    if (program && !(program->flags & PROGRAM_IN_BANK))
+        free(program);
+}
+
+// Frees the programs retired by the audio thread.
+static void programs_reclaim(WavesEngine *engine) {
+    Program *program = atomic_exchange_explicit(&engine->retired_programs, 0,
+                                                memory_order_acquire);
+    while (program) {
+        Program *next = program->next_retired;
+        free(program);
+        program = next;
+    }
+}
+
+// Hands `program` to the audio thread, see program_swap().
+static void program_publish(WavesEngine *engine, Program *program) {
+    // A program replaced before the audio thread picked it up was never seen
+    // by it, but the graph it was compiled from may still be new to it
+    uintptr_t replaced = atomic_load_explicit(&engine->pending_program,
+                                              memory_order_relaxed);
+    uintptr_t pending;
+    do
+        pending = (uintptr_t)program | (replaced & PENDING_NEW_GRAPH) |
+                  (engine->graph_replaced ? PENDING_NEW_GRAPH : 0);
+    while (!atomic_compare_exchange_weak_explicit(
+        &engine->pending_program, &replaced, pending, memory_order_acq_rel,
+        memory_order_relaxed));
+    program_free((Program *)(replaced & ~(uintptr_t)PENDING_NEW_GRAPH));
+    engine->published = program;
+    engine->graph_replaced = 0;
+
+    programs_reclaim(engine);
+}
+
+// Returns whether changing `parameter` of waveform `handle` from `from` to
+// `to` invalidates the optimizations `program` was compiled with: it makes a
+// silent connection audible, or the frequency ratio of a merged operator
+// differ from the operators it was merged with.
+static int program_stale(const Program *program, WaveformHandle handle,
+                         WaveformParameter parameter, float from, float to) {
+    if (parameter != WAVES_PARAMETER_FREQUENCY_RATIO)
+        return from == 0 && to != 0;
+    if (from == to)
+        return 0;
+
+    const uint32_t *handles = PROGRAM_ARRAY(program, handles);
+    const uint32_t *merged_into = PROGRAM_ARRAY(program, merged_into);
+    for (size_t i = 0; i < program->operator_count; i++) {
+        if (handles[i] != handle)
+            continue;
+        for (size_t j = 0; j < program->operator_count; j++)
+            if (j != i && (merged_into[j] == i || merged_into[i] == j))
+                return 1;
+    }
+    return 0;
+}
+
+int waves_compile(WavesEngine *engine) {
+    assert(engine);
+
+    // Until the graph is edited again, the previous program is kept
+    engine->program_dirty = 0;
+    Program *program = program_build(engine);
+    if (!program)
+        return 0;
+
+    program_publish(engine, program);
+    return 1;
+}
+
+// Resets the parameters of the operators to the values in the program.
+static void parameters_load(WavesEngine *engine) {
+    for (int i = 0; i < PARAMETER_COUNT; i++)
+        memcpy(engine->parameters[i], program_parameter(engine->program, i),
+               engine->program->operator_count * sizeof(float));
+}
+
+// Switches the audio thread to the last compiled program, if there is one,
+// and retires the previous program.
+static void program_swap(WavesEngine *engine) {
+    uintptr_t pending = atomic_exchange_explicit(&engine->pending_program, 0,
+                                                 memory_order_acquire);
+    Program *next = (Program *)(pending & ~(uintptr_t)PENDING_NEW_GRAPH);
+    if (!next)
+        return;
+
+    // Operators of the new program carry on from the operator of the
+    // previous program rendering the same waveform, or the one it was merged
+    // into
+    Program *previous = engine->program;
+    const uint32_t *previous_handles = PROGRAM_ARRAY(previous, handles);
+    const uint32_t *previous_merged_into =
+        PROGRAM_ARRAY(previous, merged_into);
+    const uint32_t *next_handles = PROGRAM_ARRAY(next, handles);
+    uint32_t sources[WAVES_MAX_OPERATORS];
+    uint32_t same[WAVES_MAX_OPERATORS];
+    for (size_t i = 0; i < next->operator_count; i++) {
+        sources[i] = same[i] = UINT32_MAX;
+        for (size_t j = 0; j < previous->operator_count; j++)
+            if (previous_handles[j] == next_handles[i]) {
+                sources[i] = previous_merged_into[j];
+                same[i] = j;
+            }
+    }
+
+    for (size_t i = 0; i < engine->active_voice_count; i++)
+        voice_remap(next, sources, engine->voices + engine->active_voices[i]);
+
+    // The program holds the values of parameter events that may still be
+    // queued, so the parameters of waveforms still in the graph carry on
+    // until their events are applied. A replaced graph starts from its own.
+    float parameters[PARAMETER_COUNT][WAVES_MAX_OPERATORS];
+    for (int p = 0; p < PARAMETER_COUNT; p++) {
+        const float *values = program_parameter(next, p);
+        for (size_t i = 0; i < next->operator_count; i++)
+            parameters[p][i] =
+                same[i] == UINT32_MAX || pending & PENDING_NEW_GRAPH
+                    ? values[i]
+                    : engine->parameters[p][same[i]];
+    }
+    memcpy(engine->parameters, parameters, sizeof(parameters));
+    engine->program = next;
+
+    if (previous->flags & PROGRAM_IN_BANK)
+        return;
+
+    Program *retired = atomic_load_explicit(&engine->retired_programs,
+                                            memory_order_relaxed);
+    do
+        previous->next_retired = retired;
+    while (!atomic_compare_exchange_weak_explicit(
+        &engine->retired_programs, &retired, previous, memory_order_release,
+        memory_order_relaxed));
+}
+
+#define BANK_MAGIC "WVBK"
+// Programs are stored as they are in memory, bump this whenever Program or
+// the type of any of its arrays changes.
+#define BANK_VERSION 4
+#define BANK_BYTE_ORDER 0x01020304
+// Largest waveform handle of a saved patch, which bounds the graph a loaded
+// patch is expanded into
+#define BANK_MAX_HANDLE 65535
+
+// Start of a bank file, followed by `patch_count` uint64_t byte offsets of
+// the patches from the start of the file. Every patch is a Program, aligned
+// to PROGRAM_ALIGNMENT.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    // BANK_BYTE_ORDER as written by the saving machine
+    uint32_t byte_order;
+    uint32_t patch_count;
+} BankHeader;
+
+struct WavesBank {
+    const uint8_t *data;
+    size_t size;
+};
+
+int waves_bank_save(const char *path, WavesEngine *const *engines,
+                    size_t count) {
+    assert(path);
+    assert(engines || !count);
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return 0;
+
+    BankHeader header = {
+        .magic = BANK_MAGIC,
+        .version = BANK_VERSION,
+        .byte_order = BANK_BYTE_ORDER,
+        .patch_count = count,
+    };
+    uint64_t *offsets = calloc(count ? count : 1, sizeof(uint64_t));
+    assert(offsets);
+
+    // Offsets are written once the patches are in place
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(offsets, sizeof(uint64_t), count, file);
+
+    static const uint8_t padding[PROGRAM_ALIGNMENT];
+    uint64_t offset = sizeof(header) + count * sizeof(uint64_t);
+    int failed = 0;
+    for (size_t i = 0; i < count && !failed; i++) {
+        size_t padding_size = -offset % PROGRAM_ALIGNMENT;
+        fwrite(padding, 1, padding_size, file);
+        offset += padding_size;
+
+        Program *program = program_build(engines[i]);
+        if (!program) {
+            failed = 1;
+            break;
+        }
+        program->flags |= PROGRAM_IN_BANK;
+        const uint32_t *handles = PROGRAM_ARRAY(program, handles);
+        for (size_t j = 0; j < program->operator_count; j++)
+            failed |= handles[j] > BANK_MAX_HANDLE;
+
+        fwrite(program, 1, program->size, file);
+        offsets[i] = offset;
+        offset += program->size;
+        free(program);
+    }
+
+    fseek(file, sizeof(header), SEEK_SET);
+    fwrite(offsets, sizeof(uint64_t), count, file);
+    free(offsets);
+
+    failed |= ferror(file);
+    return !(fclose(file) || failed);
+}
+
+// Returns whether `program`, with `available` bytes after its start, is a
+// well-formed program of a bank.
+static int program_valid(const Program *program, size_t available) {
+    if (available < sizeof(Program) || program->size < sizeof(Program) ||
+        program->size > available)
+        return 0;
+
+    size_t n = program->operator_count;
+    if (!(program->flags & PROGRAM_IN_BANK) || !n ||
+        n > WAVES_MAX_OPERATORS || !(program->sample_rate > 0) ||
+        program->source_count <= WAVES_SOURCE_KEY ||
+        program->source_count > WAVES_MAX_SOURCES)
+        return 0;
+
+    struct {
+        uint32_t offset;
+        size_t size;
+    } arrays[] = {
+        {program->offsets.handles, n * sizeof(uint32_t)},
+        {program->offsets.types, n * sizeof(uint8_t)},
+        {program->offsets.frequency_ratios, n * sizeof(float)},
+        {program->offsets.output_amplitudes, n * sizeof(float)},
+        {program->offsets.modulation_amplitudes, n * sizeof(float)},
+        {program->offsets.envelopes, n * sizeof(Envelope)},
+        {program->offsets.attacks, n * sizeof(EnvelopeSegment)},
+        {program->offsets.decays, n * sizeof(EnvelopeSegment)},
+        {program->offsets.releases, n * sizeof(EnvelopeSegment)},
+        {program->offsets.inputs_starts, n * sizeof(uint32_t)},
+        {program->offsets.inputs_counts, n * sizeof(uint32_t)},
+        {program->offsets.inputs,
+         program->input_count * sizeof(OperatorInput)},
+        {program->offsets.merged_into, n * sizeof(uint32_t)},
+        {program->offsets.routed, n * sizeof(uint8_t)},
+        {program->offsets.routes_starts, n * sizeof(uint32_t)},
+        {program->offsets.routes_counts, n * sizeof(uint32_t)},
+        {program->offsets.routes,
+         program->route_count * sizeof(OperatorRoute)},
+        {program->offsets.source_names,
+         program->source_count * WAVES_MAX_SOURCE_NAME},
+    };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++)
+        if (arrays[i].offset % PROGRAM_ALIGNMENT ||
+            arrays[i].offset < sizeof(Program) ||
+            arrays[i].offset + arrays[i].size > program->size)
+            return 0;
+
+    const uint32_t *handles = PROGRAM_ARRAY(program, handles);
+    const uint8_t *types = PROGRAM_ARRAY(program, types);
+    const float *frequency_ratios = PROGRAM_ARRAY(program, frequency_ratios);
+    const float *output_amplitudes = PROGRAM_ARRAY(program, output_amplitudes);
+    const float *modulation_amplitudes =
+        PROGRAM_ARRAY(program, modulation_amplitudes);
+    const Envelope *envelopes = PROGRAM_ARRAY(program, envelopes);
+    const EnvelopeSegment *attacks = PROGRAM_ARRAY(program, attacks);
+    const EnvelopeSegment *decays = PROGRAM_ARRAY(program, decays);
+    const EnvelopeSegment *releases = PROGRAM_ARRAY(program, releases);
+    const uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    const uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    const OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    const uint32_t *merged_into = PROGRAM_ARRAY(program, merged_into);
+    const uint8_t *routed = PROGRAM_ARRAY(program, routed);
+    const uint32_t *routes_starts = PROGRAM_ARRAY(program, routes_starts);
+    const uint32_t *routes_counts = PROGRAM_ARRAY(program, routes_counts);
+    const OperatorRoute *routes = PROGRAM_ARRAY(program, routes);
+    const char(*source_names)[WAVES_MAX_SOURCE_NAME] =
+        PROGRAM_ARRAY(program, source_names);
+    // Handles are unique and name waveforms of a graph of bounded size, the
+    // output waveform being the last operator
+    if (handles[n - 1] != WAVES_OUTPUT)
+        return 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!handles[i] || handles[i] > BANK_MAX_HANDLE)
+            return 0;
+        for (size_t j = 0; j < i; j++)
+            if (handles[j] == handles[i])
+                return 0;
+    }
+
+    for (size_t i = 0; i < program->source_count; i++)
+        if (!memchr(source_names[i], 0, WAVES_MAX_SOURCE_NAME))
+            return 0;
+
+    uint32_t has_feedback = 0;
+    for (size_t i = 0; i < n; i++) {
+        // The output operator is the last one, and only that one
+        if (types[i] > WAVES_WAVEFORM_OUTPUT ||
+            (types[i] == WAVES_WAVEFORM_OUTPUT) != (i == n - 1))
+            return 0;
+
+        // Operators are merged into earlier operators that are rendered
+        uint32_t merged = merged_into[i];
+        if (merged > i || merged_into[merged] != merged ||
+            (merged != i && i == n - 1))
+            return 0;
+
+        // A value that is not finite spreads to the phases, which index the
+        // wavetables
+        const Envelope *envelope = envelopes + i;
+        float values[] = {
+            frequency_ratios[i], output_amplitudes[i],
+            modulation_amplitudes[i], envelope->attack,
+            envelope->decay,     envelope->sustain,
+            envelope->release,   attacks[i].coef,
+            attacks[i].base,     attacks[i].target,
+            decays[i].coef,      decays[i].base,
+            decays[i].target,    releases[i].coef,
+            releases[i].base,    releases[i].target,
+        };
+        for (size_t j = 0; j < sizeof(values) / sizeof(*values); j++)
+            if (!isfinite(values[j]))
+                return 0;
+        if (envelope->curve > WAVES_CURVE_EXPONENTIAL)
+            return 0;
 
-    return output_amplitude;
+        if ((size_t)inputs_starts[i] + inputs_counts[i] > program->input_count)
+            return 0;
+        for (size_t j = 0; j < inputs_counts[i]; j++) {
+            const OperatorInput *input = inputs + inputs_starts[i] + j;
+            if (input->source >= n || input->feedback != (input->source >= i))
+                return 0;
+            has_feedback |= input->feedback;
+        }
+
+        if ((size_t)routes_starts[i] + routes_counts[i] > program->route_count)
+            return 0;
+        uint8_t parameters = 0;
+        for (size_t j = 0; j < routes_counts[i]; j++) {
+            const OperatorRoute *route = routes + routes_starts[i] + j;
+            if (!route->source || route->source >= program->source_count ||
+                route->parameter >= PARAMETER_COUNT || !isfinite(route->depth))
+                return 0;
+            parameters |= 1 << route->parameter;
+        }
+        if (routed[i] != parameters)
+            return 0;
+    }
+    return program->has_feedback == has_feedback &&
+           program->kernel == kernel_match(program);
 }
 
-void waves_note_on(uint8_t note, uint8_t velocity) {
-    assert(note < MIDI_NOTE_COUNT);
-    notes[note].velocity = velocity;
-    notes[note].active = 1;
-    notes[note].press_time = time;
+WavesBank *waves_bank_load(const char *path) {
+    assert(path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(BankHeader)) {
+        close(fd);
+        return 0;
+    }
+
+    size_t size = st.st_size;
+    const uint8_t *data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    const BankHeader *header = (const BankHeader *)data;
+    int valid = !memcmp(header->magic, BANK_MAGIC, 4) &&
+                header->version == BANK_VERSION &&
+                header->byte_order == BANK_BYTE_ORDER &&
+                header->patch_count <=
+                    (size - sizeof(BankHeader)) / sizeof(uint64_t);
+
+    const uint64_t *offsets = (const uint64_t *)(header + 1);
+    for (size_t i = 0; valid && i < header->patch_count; i++)
+        valid = offsets[i] % PROGRAM_ALIGNMENT == 0 && offsets[i] < size &&
+                program_valid((const Program *)(data + offsets[i]),
+                              size - offsets[i]);
+
+    if (!valid) {
+        munmap((void *)data, size);
+        return 0;
+    }
+
+    WavesBank *bank = malloc(sizeof(WavesBank));
+    assert(bank);
+    *bank = (WavesBank){
+        .data = data,
+        .size = size,
+    };
+    return bank;
 }
 
-void waves_note_off(uint8_t note) {
-    assert(note < MIDI_NOTE_COUNT);
-    notes[note].release_time = time;
+void waves_bank_free(WavesBank *bank) {
+    if (!bank)
+        return;
+
+    munmap((void *)bank->data, bank->size);
+    free(bank);
 }
 
-void waves_all_notes_off(void) {
-    for (uint32_t i = 0; i < MIDI_NOTE_COUNT; i++)
-        notes[i].release_time = time;
+size_t waves_bank_patch_count(const WavesBank *bank) {
+    assert(bank);
+    return ((const BankHeader *)bank->data)->patch_count;
 }
 
-float waves_get_frame(void) {
-    time += 1.0 / waveform_sample_rate;
+// Replaces the graph of `engine` with the graph `program` was compiled from,
+// reusing the memory of the current graph.
+static void graph_load(WavesEngine *engine, const Program *program) {
+    const uint32_t *handles = PROGRAM_ARRAY(program, handles);
+    const uint8_t *types = PROGRAM_ARRAY(program, types);
+    const float *frequency_ratios = PROGRAM_ARRAY(program, frequency_ratios);
+    const float *output_amplitudes = PROGRAM_ARRAY(program, output_amplitudes);
+    const float *modulation_amplitudes =
+        PROGRAM_ARRAY(program, modulation_amplitudes);
+    const Envelope *envelopes = PROGRAM_ARRAY(program, envelopes);
+    const uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    const uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    const OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    const uint32_t *routes_starts = PROGRAM_ARRAY(program, routes_starts);
+    const uint32_t *routes_counts = PROGRAM_ARRAY(program, routes_counts);
+    const OperatorRoute *routes = PROGRAM_ARRAY(program, routes);
+
+    WaveformHandle handle_count = WAVES_OUTPUT + 1;
+    for (size_t i = 0; i < program->operator_count; i++)
+        if (handles[i] >= handle_count)
+            handle_count = handles[i] + 1;
+
+    // Handles missing from the program are left as unconnected waveforms
+    WaveformVec *waveforms = &engine->waveforms;
+    waveforms->data_used = 0;
+    engine->graph_replaced = 1;
+    for (size_t i = 0; i < handle_count; i++)
+        wfvec_append(waveforms, (Waveform){.envelope = {.sustain = 1.0}});
+    waveforms->data[0] = (Waveform){0};
 
-    float sample = 0;
+    // Macros are part of the patch
+    memcpy(engine->source_names, PROGRAM_ARRAY(program, source_names),
+           program->source_count * WAVES_MAX_SOURCE_NAME);
+    engine->source_count = program->source_count;
+
+    engine->connections.data_used = 0;
+    engine->routes.data_used = 0;
+    for (size_t i = 0; i < program->operator_count; i++) {
+        waveforms->data[handles[i]] = (Waveform){
+            .output_amplitude = output_amplitudes[i],
+            .modulation_amplitude = modulation_amplitudes[i],
+            .frequency_ratio = frequency_ratios[i],
+            .type = types[i],
+            .envelope = envelopes[i],
+        };
+
+        for (size_t j = 0; j < inputs_counts[i]; j++) {
+            const OperatorInput *input = inputs + inputs_starts[i] + j;
+            wfconnvec_append(&engine->connections,
+                             (WaveformConnection){
+                                 .from = handles[input->source],
+                                 .to = handles[i],
+                             });
+        }
 
-    for (uint8_t i = 0; i < MIDI_NOTE_COUNT; i++) {
-        if (notes[i].active) {
-            printf("note %u\n", i);
-            sample += waveform_get_frame(WAVES_OUTPUT, notes + i, 0);
+        for (size_t j = 0; j < routes_counts[i]; j++) {
+            const OperatorRoute *route = routes + routes_starts[i] + j;
+            WavesRoute graph_route = {
+                .source = route->source,
+                .waveform = handles[i],
+                .parameter = route->parameter,
+                .depth = route->depth,
+            };
+            wfroutevec_append(&engine->routes, graph_route);
         }
     }
-    printf("asd\n");
+}
+
+void waves_bank_select(WavesEngine *engine, const WavesBank *bank,
+                       size_t index) {
+    assert(engine);
+    assert(bank);
+    assert(index < waves_bank_patch_count(bank));
+
+    const uint64_t *offsets =
+        (const uint64_t *)((const BankHeader *)bank->data + 1);
+    Program *program = (Program *)(bank->data + offsets[index]);
+
+    graph_load(engine, program);
+    if (program->sample_rate != engine->sample_rate) {
+        // Envelope segments depend on the sample rate
+        waves_compile(engine);
+        return;
+    }
+
+    program_publish(engine, program);
+    engine->program_dirty = 0;
+}
+
+// Coefficients of the odd polynomial approximating sin(2 * pi * x) on
+// [0, 0.25], fitted with the Remez exchange algorithm. The polynomial alone
+// is within 3.4e-9 of the real function, evaluated in single precision the
+// maximum absolute error of sin_turns() over all inputs in [-1e3, 1e3] is
+// below 2.5e-7 (about -132 dB).
+#define SIN_C1 6.2831851600894835f
+#define SIN_C3 -41.34165503141761f
+#define SIN_C5 81.60100407334106f
+#define SIN_C7 -76.54978229534504f
+#define SIN_C9 39.53670607844828f
+
+// Returns sin(2 * pi * x). The argument is reduced to [-0.5, 0.5] turns, so
+// precision degrades slowly for large |x| instead of breaking down.
+static inline float sin_turns(float x) {
+    x -= rintf(x);
+    float a = fabsf(x);
+    a = fminf(a, 0.5f - a);
+    float a2 = a * a;
+    float y =
+        (((SIN_C9 * a2 + SIN_C7) * a2 + SIN_C5) * a2 + SIN_C3) * a2 + SIN_C1;
+    return copysignf(y * a, x);
+}
+
+// A vector of LANES floats, with the few operations the renderers need.
+#if LANES == 8
+typedef __m256 Lanes;
+
+static inline Lanes lanes_load(const float *p) {
+    return _mm256_loadu_ps(p);
+}
+static inline void lanes_store(float *p, Lanes a) {
+    _mm256_storeu_ps(p, a);
+}
+static inline Lanes lanes_set(float a) {
+    return _mm256_set1_ps(a);
+}
+static inline Lanes lanes_add(Lanes a, Lanes b) {
+    return _mm256_add_ps(a, b);
+}
+static inline Lanes lanes_mul(Lanes a, Lanes b) {
+    return _mm256_mul_ps(a, b);
+}
+// Returns a * b + c
+static inline Lanes lanes_fmadd(Lanes a, Lanes b, Lanes c) {
+    return _mm256_fmadd_ps(a, b, c);
+}
+
+// sin_turns() of every lane.
+static inline Lanes lanes_sin_turns(Lanes x) {
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    x = _mm256_sub_ps(
+        x, _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    __m256 sign = _mm256_and_ps(x, sign_mask);
+    __m256 a = _mm256_andnot_ps(sign_mask, x);
+    a = _mm256_min_ps(a, _mm256_sub_ps(_mm256_set1_ps(0.5f), a));
+    __m256 a2 = _mm256_mul_ps(a, a);
+    __m256 y =
+        _mm256_fmadd_ps(_mm256_set1_ps(SIN_C9), a2, _mm256_set1_ps(SIN_C7));
+    y = _mm256_fmadd_ps(y, a2, _mm256_set1_ps(SIN_C5));
+    y = _mm256_fmadd_ps(y, a2, _mm256_set1_ps(SIN_C3));
+    y = _mm256_fmadd_ps(y, a2, _mm256_set1_ps(SIN_C1));
+    y = _mm256_mul_ps(y, a);
+    return _mm256_xor_ps(y, sign);
+}
+#elif LANES == 4
+typedef __m128 Lanes;
+
+static inline Lanes lanes_load(const float *p) {
+    return _mm_loadu_ps(p);
+}
+static inline void lanes_store(float *p, Lanes a) {
+    _mm_storeu_ps(p, a);
+}
+static inline Lanes lanes_set(float a) {
+    return _mm_set1_ps(a);
+}
+static inline Lanes lanes_add(Lanes a, Lanes b) {
+    return _mm_add_ps(a, b);
+}
+static inline Lanes lanes_mul(Lanes a, Lanes b) {
+    return _mm_mul_ps(a, b);
+}
+// Returns a * b + c
+static inline Lanes lanes_fmadd(Lanes a, Lanes b, Lanes c) {
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+}
+
+// sin_turns() of every lane.
+static inline Lanes lanes_sin_turns(Lanes x) {
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+    x = _mm_sub_ps(
+        x, _mm_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    __m128 sign = _mm_and_ps(x, sign_mask);
+    __m128 a = _mm_andnot_ps(sign_mask, x);
+    a = _mm_min_ps(a, _mm_sub_ps(_mm_set1_ps(0.5f), a));
+    __m128 a2 = _mm_mul_ps(a, a);
+    __m128 y =
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(SIN_C9), a2), _mm_set1_ps(SIN_C7));
+    y = _mm_add_ps(_mm_mul_ps(y, a2), _mm_set1_ps(SIN_C5));
+    y = _mm_add_ps(_mm_mul_ps(y, a2), _mm_set1_ps(SIN_C3));
+    y = _mm_add_ps(_mm_mul_ps(y, a2), _mm_set1_ps(SIN_C1));
+    y = _mm_mul_ps(y, a);
+    return _mm_xor_ps(y, sign);
+}
+#else
+typedef float Lanes;
+
+static inline Lanes lanes_load(const float *p) {
+    return *p;
+}
+static inline void lanes_store(float *p, Lanes a) {
+    *p = a;
+}
+static inline Lanes lanes_set(float a) {
+    return a;
+}
+static inline Lanes lanes_add(Lanes a, Lanes b) {
+    return a + b;
+}
+static inline Lanes lanes_mul(Lanes a, Lanes b) {
+    return a * b;
+}
+// Returns a * b + c
+static inline Lanes lanes_fmadd(Lanes a, Lanes b, Lanes c) {
+    return a * b + c;
+}
+static inline Lanes lanes_sin_turns(Lanes x) {
+    return sin_turns(x);
+}
+#endif
+
+// Vectorized sin_turns() over `count` values of `in`.
+static void sin_turns_block(const float *in, float *out, size_t count) {
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES)
+        lanes_store(out + i, lanes_sin_turns(lanes_load(in + i)));
+    for (; i < count; i++)
+        out[i] = sin_turns(in[i]);
+}
+
+#define WAVETABLE_SIZE 2048
+// One level per octave, level `n` holding harmonics up to
+// WAVETABLE_SIZE / 2 >> n.
+#define WAVETABLE_LEVELS 11
+#define WAVETABLE_SHAPES 3
+
+// Band-limited triangle, saw and square tables with two guard samples for
+// interpolation. Shared by all engines, never written after being built.
+static float wavetables[WAVETABLE_SHAPES][WAVETABLE_LEVELS]
+                       [WAVETABLE_SIZE + 2];
+static pthread_once_t wavetables_once = PTHREAD_ONCE_INIT;
+
+// Returns the amplitude of harmonic `harmonic` in the Fourier series of a
+// waveform with a peak amplitude of 1.
+static double wavetable_harmonic(WaveformType type, int harmonic) {
+    int odd = harmonic % 2;
+    switch (type) {
+    case WAVES_WAVEFORM_TRIANGLE:
+        return odd ? ((harmonic / 2) % 2 ? -8 : 8) /
+                         (M_PI * M_PI * harmonic * harmonic)
+                   : 0;
+    case WAVES_WAVEFORM_SAW:
+        return (odd ? 2 : -2) / (M_PI * harmonic);
+    case WAVES_WAVEFORM_SQUARE:
+        return odd ? 4 / (M_PI * harmonic) : 0;
+    case WAVES_WAVEFORM_SINE:
+    case WAVES_WAVEFORM_OUTPUT:
+        break;
+    }
+    return 0;
+}
+
+// Sums the harmonics of every level additively, starting from the level
+// with only the fundamental and adding the harmonics of each finer level on
+// top of the previous one.
+static void wavetables_build(void) {
+    static double sine[WAVETABLE_SIZE];
+    static double sum[WAVETABLE_SIZE];
+    for (int i = 0; i < WAVETABLE_SIZE; i++)
+        sine[i] = sin(2 * M_PI * i / WAVETABLE_SIZE);
+
+    for (int shape = 0; shape < WAVETABLE_SHAPES; shape++) {
+        WaveformType type = WAVES_WAVEFORM_TRIANGLE + shape;
+        memset(sum, 0, sizeof(sum));
+
+        int harmonic = 1;
+        for (int level = WAVETABLE_LEVELS - 1; level >= 0; level--) {
+            for (; harmonic <= WAVETABLE_SIZE / 2 >> level; harmonic++) {
+                double amplitude = wavetable_harmonic(type, harmonic);
+                if (!amplitude)
+                    continue;
+                for (int i = 0; i < WAVETABLE_SIZE; i++)
+                    sum[i] += amplitude * sine[harmonic * i % WAVETABLE_SIZE];
+            }
+
+            float *table = wavetables[shape][level];
+            for (int i = 0; i < WAVETABLE_SIZE; i++)
+                table[i] = sum[i];
+            table[WAVETABLE_SIZE] = table[0];
+            table[WAVETABLE_SIZE + 1] = table[1];
+        }
+    }
+}
+
+// Builds the tables on the first call.
+static void wavetables_init(void) {
+    pthread_once(&wavetables_once, wavetables_build);
+}
+
+// Returns the table of waveform `type` for an oscillator advancing `step`
+// turns per frame, with no harmonics above the Nyquist frequency.
+static const float *wavetable_get(WaveformType type, double step) {
+    int level = 0;
+    int exponent;
+    frexp(step * WAVETABLE_SIZE, &exponent);
+    if (exponent > 0)
+        level = exponent < WAVETABLE_LEVELS ? exponent : WAVETABLE_LEVELS - 1;
+    return wavetables[type - WAVES_WAVEFORM_TRIANGLE][level];
+}
+
+// Reads `table` at the phases in turns of `in` with linear interpolation.
+// Returns the value of `table` at `x` turns, interpolated linearly.
+// The index is wrapped into the table, which keeps a phase that is not
+// finite from reading outside of it.
+static inline float wavetable_lookup(const float *table, float x) {
+    float position = (x - floorf(x)) * WAVETABLE_SIZE;
+    int index = position;
+    float fraction = position - index;
+    index &= WAVETABLE_SIZE - 1;
+    return table[index] + fraction * (table[index + 1] - table[index]);
+}
+
+static void wavetable_block(const float *table, const float *in, float *out,
+                            size_t count) {
+    size_t i = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256 size = _mm256_set1_ps(WAVETABLE_SIZE);
+    const __m256i mask = _mm256_set1_epi32(WAVETABLE_SIZE - 1);
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + i);
+        x = _mm256_sub_ps(x, _mm256_floor_ps(x));
+        __m256 position = _mm256_mul_ps(x, size);
+        __m256i index = _mm256_cvttps_epi32(position);
+        __m256 fraction =
+            _mm256_sub_ps(position, _mm256_cvtepi32_ps(index));
+        index = _mm256_and_si256(index, mask);
+        __m256 a = _mm256_i32gather_ps(table, index, 4);
+        __m256 b = _mm256_i32gather_ps(table + 1, index, 4);
+        _mm256_storeu_ps(out + i,
+                         _mm256_fmadd_ps(fraction, _mm256_sub_ps(b, a), a));
+    }
+#endif
+
+    for (; i < count; i++)
+        out[i] = wavetable_lookup(table, in[i]);
+}
+
+// Returns `parameter` of operator `index` for `voice`, its base value plus
+// the values of the sources routed to it.
+static float control_target(const WavesEngine *engine, const Voice *voice,
+                            size_t index, WaveformParameter parameter) {
+    const Program *program = engine->program;
+    const uint32_t *routes_starts = PROGRAM_ARRAY(program, routes_starts);
+    const uint32_t *routes_counts = PROGRAM_ARRAY(program, routes_counts);
+    const OperatorRoute *routes = PROGRAM_ARRAY(program, routes);
+
+    float value = engine->parameters[parameter][index];
+    for (size_t i = 0; i < routes_counts[index]; i++) {
+        const OperatorRoute *route = routes + routes_starts[index] + i;
+        if (route->parameter != parameter)
+            continue;
+
+        float source;
+        switch (route->source) {
+        case WAVES_SOURCE_VELOCITY:
+            source = voice->velocity / 127.0f;
+            break;
+        case WAVES_SOURCE_KEY:
+            source = (voice->note - 60) / 12.0f;
+            break;
+        default:
+            source = engine->source_values[route->source];
+        }
+        value += source * route->depth;
+    }
+    return value;
+}
+
+// Writes the next `frames` values of routed parameter `parameter` of
+// operator `index` to `out`. The target value is evaluated once every
+// WAVES_CONTROL_INTERVAL frames and approached linearly over the interval,
+// a voice's first value is the target itself.
+static void control_render(const WavesEngine *engine, const Voice *voice,
+                           OperatorState *state, size_t index,
+                           WaveformParameter parameter, float *out,
+                           size_t frames) {
+    float value = state->control_values[parameter];
+    float step = state->control_steps[parameter];
+    size_t remaining = state->control_remaining[parameter];
+
+    if (!(state->control_started & 1 << parameter)) {
+        value = control_target(engine, voice, index, parameter);
+        state->control_targets[parameter] = value;
+        state->control_started |= 1 << parameter;
+    }
+
+    for (size_t k = 0; k < frames; k++) {
+        if (!remaining) {
+            // Land exactly on the last target before heading to the next
+            value = state->control_targets[parameter];
+            float target = control_target(engine, voice, index, parameter);
+            state->control_targets[parameter] = target;
+            step = (target - value) / WAVES_CONTROL_INTERVAL;
+            remaining = WAVES_CONTROL_INTERVAL;
+        }
+
+        value += step;
+        remaining--;
+        out[k] = value;
+    }
+
+    state->control_values[parameter] = value;
+    state->control_steps[parameter] = step;
+    state->control_remaining[parameter] = remaining;
+}
+
+// Returns whether `input` of operator `index` is the operator feeding back
+// into itself, with an amplitude that is not routed. Such an operator is
+// rendered for the whole block, one frame at a time within its own loop.
+static int input_self_feedback(const Program *program, size_t index,
+                               const OperatorInput *input) {
+    const uint8_t *types = PROGRAM_ARRAY(program, types);
+    const uint8_t *routed = PROGRAM_ARRAY(program, routed);
+    return input->source == index && types[index] != WAVES_WAVEFORM_OUTPUT &&
+           !(routed[index] & 1 << WAVES_PARAMETER_MODULATION_AMPLITUDE);
+}
+
+// Renders the next `frames` samples of operators `first` to `last`, not
+// included, of the program for `voice`, starting at frame `offset` of their
+// buffers. Bit `i` of `silent` is set once operator `i` is found to be
+// silent, its samples are zeroed nonetheless.
+static void operators_render(const WavesEngine *engine,
+                             RenderScratch *scratch, Voice *voice,
+                             size_t first, size_t last, size_t offset,
+                             size_t frames, uint64_t *silent) {
+    const Program *program = engine->program;
+    const uint8_t *types = PROGRAM_ARRAY(program, types);
+    const float *frequency_ratios =
+        engine->parameters[WAVES_PARAMETER_FREQUENCY_RATIO];
+    const float *output_amplitudes =
+        engine->parameters[WAVES_PARAMETER_OUTPUT_AMPLITUDE];
+    const float *modulation_amplitudes =
+        engine->parameters[WAVES_PARAMETER_MODULATION_AMPLITUDE];
+    const uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    const uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    const OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    const uint32_t *merged_into = PROGRAM_ARRAY(program, merged_into);
+    const uint8_t *routed = PROGRAM_ARRAY(program, routed);
+
+    OperatorState *states = voice->operators;
+    double sample_period = 1.0 / engine->sample_rate;
+
+    for (size_t i = first; i < last; i++) {
+        if (merged_into[i] != i)
+            continue;
+
+        WaveformType type = types[i];
+        float *out = scratch->operator_buffers[i] + offset;
+        int is_output = type == WAVES_WAVEFORM_OUTPUT;
+        WaveformParameter amplitude_parameter =
+            is_output ? WAVES_PARAMETER_OUTPUT_AMPLITUDE
+                      : WAVES_PARAMETER_MODULATION_AMPLITUDE;
+        const float *amplitudes =
+            is_output ? output_amplitudes : modulation_amplitudes;
+
+        float modulation[WAVES_BLOCK_SIZE];
+        memset(modulation, 0, frames * sizeof(float));
+        // Amplitude of the operator feeding back into itself, see
+        // program_cycles()
+        float self_amplitude = 0;
+        int self_feedback = 0;
+        for (size_t j = 0; j < inputs_counts[i]; j++) {
+            const OperatorInput *input = inputs + inputs_starts[i] + j;
+            uint32_t source = input->source;
+            uint32_t rendered = merged_into[source];
+            float amplitude = amplitudes[source];
+            int amplitude_routed = routed[source] & 1 << amplitude_parameter;
+
+            if (input_self_feedback(program, i, input)) {
+                self_amplitude += amplitude;
+                self_feedback = 1;
+                continue;
+            }
+
+            if (input->feedback) {
+                // Only rendered one frame at a time, see program_render()
+                if (amplitude_routed)
+                    amplitude =
+                        states[source].control_values[amplitude_parameter];
+                modulation[0] += states[rendered].last_output * amplitude;
+                continue;
+            }
+
+            if (*silent >> rendered & 1)
+                continue;
+
+            float *source_buffer = scratch->operator_buffers[rendered] + offset;
+            if (amplitude_routed) {
+                float *ramp =
+                    scratch->amplitude_buffers[source][amplitude_parameter] +
+                    offset;
+                for (size_t k = 0; k < frames; k++)
+                    modulation[k] += source_buffer[k] * ramp[k];
+                continue;
+            }
+
+            for (size_t k = 0; k < frames; k++)
+                modulation[k] += source_buffer[k] * amplitude;
+        }
+        if (is_output) {
+            memcpy(out, modulation, frames * sizeof(float));
+            continue;
+        }
+
+        OperatorState *state = states + i;
+        if (state->envelope_stage == ENVELOPE_OFF) {
+            // A finished envelope never restarts, so the oscillator is not
+            // needed anymore
+            *silent |= (uint64_t)1 << i;
+            memset(out, 0, frames * sizeof(float));
+            state->last_output = 0;
+            continue;
+        }
+
+        float envelope[WAVES_BLOCK_SIZE];
+        envelope_render(program, i, state, envelope, frames);
+
+        // Modulation is in radians, the oscillators work in turns
+        double phase_step =
+            voice->frequency * frequency_ratios[i] * sample_period;
+        float argument[WAVES_BLOCK_SIZE];
+        if (routed[i] & 1 << WAVES_PARAMETER_FREQUENCY_RATIO) {
+            float ratios[WAVES_BLOCK_SIZE];
+            control_render(engine, voice, state, i,
+                           WAVES_PARAMETER_FREQUENCY_RATIO, ratios, frames);
+
+            double phase = state->phase;
+            for (size_t k = 0; k < frames; k++) {
+                phase_step = voice->frequency * ratios[k] * sample_period;
+                phase += phase_step;
+                argument[k] = phase + modulation[k] * (float)(0.5 / M_PI);
+            }
+            state->phase = phase - floor(phase);
+        } else {
+            float phase = state->phase;
+            float step = phase_step;
+            for (size_t k = 0; k < frames; k++)
+                argument[k] = phase + (k + 1) * step +
+                              modulation[k] * (float)(0.5 / M_PI);
+
+            double next_phase = state->phase + frames * phase_step;
+            state->phase = next_phase - floor(next_phase);
+        }
+
+        if (self_feedback) {
+            // Every frame is modulated by the previous one
+            const float *table =
+                type == WAVES_WAVEFORM_SINE ? 0
+                                            : wavetable_get(type, phase_step);
+            float feedback = self_amplitude * (float)(0.5 / M_PI);
+            float previous = state->last_output;
+            for (size_t k = 0; k < frames; k++) {
+                float x = argument[k] + previous * feedback;
+                float sample =
+                    table ? wavetable_lookup(table, x) : sin_turns(x);
+                out[k] = previous = sample * envelope[k];
+            }
+        } else {
+            switch (type) {
+            case WAVES_WAVEFORM_SINE:
+                sin_turns_block(argument, out, frames);
+                break;
+
+            case WAVES_WAVEFORM_TRIANGLE:
+            case WAVES_WAVEFORM_SAW:
+            case WAVES_WAVEFORM_SQUARE:
+                wavetable_block(wavetable_get(type, phase_step), argument,
+                                out, frames);
+                break;
+
+            case WAVES_WAVEFORM_OUTPUT:
+                break;
+            }
+
+            for (size_t k = 0; k < frames; k++)
+                out[k] *= envelope[k];
+        }
+
+        states[i].last_output = out[frames - 1];
+
+        for (int parameter = WAVES_PARAMETER_OUTPUT_AMPLITUDE;
+             parameter <= WAVES_PARAMETER_MODULATION_AMPLITUDE; parameter++)
+            if (routed[i] & 1 << parameter)
+                control_render(engine, voice, state, i, parameter,
+                               scratch->amplitude_buffers[i][parameter] +
+                                   offset,
+                               frames);
+    }
+}
+
+// Returns the operators that have to be rendered one frame at a time, from
+// the first to the last operator of every cycle other than an operator
+// feeding back into itself. Operators are ordered so that only inputs closing
+// a cycle read later operators, so the operators after a cycle never feed back
+// into it.
+static uint64_t program_cycles(const Program *program) {
+    if (!program->has_feedback)
+        return 0;
+
+    const uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    const uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    const OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    const uint32_t *merged_into = PROGRAM_ARRAY(program, merged_into);
+
+    uint64_t cycles = 0;
+    for (size_t i = 0; i < program->operator_count; i++)
+        for (size_t j = 0; j < inputs_counts[i]; j++) {
+            const OperatorInput *input = inputs + inputs_starts[i] + j;
+            if (!input->feedback || input_self_feedback(program, i, input))
+                continue;
+
+            // The operator fed back may be rendered by an earlier one
+            size_t from = i < merged_into[input->source]
+                              ? i
+                              : merged_into[input->source];
+            for (size_t k = from; k <= input->source; k++)
+                cycles |= (uint64_t)1 << k;
+        }
+    return cycles;
+}
+
+// Renders the next `frames` samples of every operator in the program for
+// `voice`. Returns the output operator's buffer.
+// Cycles in the graph are fed back with a one sample delay, which requires
+// rendering their operators one frame at a time. The operators before and
+// after them are rendered for the whole block.
+static float *program_render(const WavesEngine *engine,
+                             RenderScratch *scratch, Voice *voice,
+                             size_t frames) {
+    const Program *program = engine->program;
+    size_t n = program->operator_count;
+    uint64_t cycles = program_cycles(program);
+    // Bit `i` is set if operator `i` is silent for the whole block
+    uint64_t silent = 0;
+
+    size_t last;
+    for (size_t first = 0; first < n; first = last) {
+        uint64_t in_cycle = cycles >> first & 1;
+        for (last = first + 1; last < n && (cycles >> last & 1) == in_cycle;
+             last++)
+            ;
+
+        if (!in_cycle) {
+            operators_render(engine, scratch, voice, first, last, 0, frames,
+                             &silent);
+            continue;
+        }
+
+        // An operator falling silent in a cycle is only silent from that
+        // frame on, its buffer holds the frames before it
+        for (size_t k = 0; k < frames; k++) {
+            uint64_t frame_silent = silent;
+            operators_render(engine, scratch, voice, first, last, k, 1,
+                             &frame_silent);
+        }
+    }
+
+    return scratch->operator_buffers[n - 1];
+}
+
+// Renderers of fixed topologies, unrolled and fused into a single pass over
+// the block instead of one pass per operator and input.
+
+// Size of the largest topology with a kernel, in operators
+#define KERNEL_MAX_OPERATORS 8
+
+// Offsets from the first frame of a lane vector, one past the frame index.
+static const float lane_frames[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+// Renders `stacks` chains of `depth` sine operators, each modulating the
+// next, the last operator of every chain connected to the output. This is
+// program_render() for such programs with the operator and input loops
+// unrolled, see KERNEL_STACKS.
+static inline __attribute__((always_inline)) float *
+stacks_render(const WavesEngine *engine, RenderScratch *scratch, Voice *voice,
+              size_t frames, int stacks, int depth) {
+    const Program *program = engine->program;
+    const float *frequency_ratios =
+        engine->parameters[WAVES_PARAMETER_FREQUENCY_RATIO];
+    const float *output_amplitudes =
+        engine->parameters[WAVES_PARAMETER_OUTPUT_AMPLITUDE];
+    const float *modulation_amplitudes =
+        engine->parameters[WAVES_PARAMETER_MODULATION_AMPLITUDE];
+    int count = stacks * depth;
+    OperatorState *states = voice->operators;
+    double sample_period = 1.0 / engine->sample_rate;
+    assert(frames);
+
+    // Envelopes go to the operator buffers, padded with silence to whole
+    // lane vectors
+    size_t padded = (frames + LANES - 1) / LANES * LANES;
+    Lanes phases[KERNEL_MAX_OPERATORS];
+    Lanes steps[KERNEL_MAX_OPERATORS];
+    Lanes amplitudes[KERNEL_MAX_OPERATORS];
+    Lanes outputs[KERNEL_MAX_OPERATORS];
+#pragma GCC unroll 8
+    for (int i = 0; i < count; i++) {
+        float *envelope = scratch->operator_buffers[i];
+        envelope_render(program, i, states + i, envelope, frames);
+        memset(envelope + frames, 0, (padded - frames) * sizeof(float));
+
+        double phase_step =
+            voice->frequency * frequency_ratios[i] * sample_period;
+        phases[i] = lanes_set(states[i].phase);
+        steps[i] = lanes_set(phase_step);
+        outputs[i] = lanes_set(0);
+        amplitudes[i] = lanes_set(i % depth == depth - 1
+                                      ? output_amplitudes[i]
+                                      : modulation_amplitudes[i]);
+
+        double next_phase = states[i].phase + frames * phase_step;
+        states[i].phase = next_phase - floor(next_phase);
+    }
+
+    // Modulation is in radians, the oscillators work in turns
+    Lanes radians_to_turns = lanes_set(0.5 / M_PI);
+    float *out = scratch->operator_buffers[count];
+    for (size_t k = 0; k < padded; k += LANES) {
+        Lanes frame = lanes_add(lanes_set(k), lanes_load(lane_frames));
+        Lanes mix = lanes_set(0);
+#pragma GCC unroll 8
+        for (int j = 0; j < stacks; j++) {
+            Lanes modulation = lanes_set(0);
+#pragma GCC unroll 8
+            for (int i = j * depth; i < (j + 1) * depth; i++) {
+                Lanes envelope = lanes_load(scratch->operator_buffers[i] + k);
+                Lanes argument = lanes_fmadd(frame, steps[i], phases[i]);
+                argument = lanes_fmadd(modulation, radians_to_turns, argument);
+                outputs[i] = lanes_mul(lanes_sin_turns(argument), envelope);
+                modulation = lanes_mul(outputs[i], amplitudes[i]);
+            }
+            mix = lanes_add(mix, modulation);
+        }
+        lanes_store(out + k, mix);
+    }
+
+    float last[LANES];
+#pragma GCC unroll 8
+    for (int i = 0; i < count; i++) {
+        lanes_store(last, outputs[i]);
+        states[i].last_output = last[(frames - 1) % LANES];
+    }
+
+    return out;
+}
+
+// Defines kernel_stacks_<stacks>x<depth>(), see stacks_render().
+#define KERNEL_STACKS(stacks, depth)                                           \
+    static float *kernel_stacks_##stacks##x##depth(                            \
+        const WavesEngine *engine, RenderScratch *scratch, Voice *voice,       \
+        size_t frames) {                                                       \
+        return stacks_render(engine, scratch, voice, frames, stacks, depth);   \
+    }
+
+// Parallel carriers
+KERNEL_STACKS(1, 1)
+KERNEL_STACKS(2, 1)
+KERNEL_STACKS(4, 1)
+KERNEL_STACKS(6, 1)
+KERNEL_STACKS(8, 1)
+// Modulator chains, up to the DX7 6-operator stack
+KERNEL_STACKS(1, 2)
+KERNEL_STACKS(1, 3)
+KERNEL_STACKS(1, 4)
+KERNEL_STACKS(1, 6)
+// Parallel stacks of DX7 algorithms 1 and 5, and 4-operator FM
+KERNEL_STACKS(2, 2)
+KERNEL_STACKS(3, 2)
+KERNEL_STACKS(2, 3)
+
+typedef float *(*ProgramRenderer)(const WavesEngine *engine,
+                                  RenderScratch *scratch, Voice *voice,
+                                  size_t frames);
+
+// Kernel 0 is program_render(), which renders any program.
+static const struct {
+    uint8_t stacks;
+    uint8_t depth;
+    ProgramRenderer render;
+} kernels[] = {
+    {0, 0, program_render},
+    {1, 1, kernel_stacks_1x1},
+    {2, 1, kernel_stacks_2x1},
+    {4, 1, kernel_stacks_4x1},
+    {6, 1, kernel_stacks_6x1},
+    {8, 1, kernel_stacks_8x1},
+    {1, 2, kernel_stacks_1x2},
+    {1, 3, kernel_stacks_1x3},
+    {1, 4, kernel_stacks_1x4},
+    {1, 6, kernel_stacks_1x6},
+    {2, 2, kernel_stacks_2x2},
+    {3, 2, kernel_stacks_3x2},
+    {2, 3, kernel_stacks_2x3},
+};
+
+// Returns the index of the kernel rendering `program`: the first one whose
+// topology the program has, with sine operators only and nothing a kernel
+// does not handle, or 0.
+static uint32_t kernel_match(const Program *program) {
+    const uint8_t *types = PROGRAM_ARRAY(program, types);
+    const uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    const uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    const OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    const uint32_t *merged_into = PROGRAM_ARRAY(program, merged_into);
+
+    size_t output = program->operator_count - 1;
+    if (program->route_count || program->has_feedback)
+        return 0;
+
+    for (uint32_t k = 1; k < sizeof(kernels) / sizeof(*kernels); k++) {
+        size_t stacks = kernels[k].stacks;
+        size_t depth = kernels[k].depth;
+        if (output != stacks * depth || inputs_counts[output] != stacks)
+            continue;
+
+        int match = 1;
+        for (size_t i = 0; i < output && match; i++) {
+            // Every operator but the first of a chain reads the previous one
+            size_t expected = i % depth ? 1 : 0;
+            match = types[i] == WAVES_WAVEFORM_SINE && merged_into[i] == i &&
+                    inputs_counts[i] == expected &&
+                    (!expected || inputs[inputs_starts[i]].source == i - 1);
+        }
+        for (size_t j = 0; j < stacks && match; j++)
+            match = inputs[inputs_starts[output] + j].source ==
+                    j * depth + depth - 1;
+
+        if (match)
+            return k;
+    }
+    return 0;
+}
+
+// Frames of a voice group rendered at a time by lanes_render(), so that the
+// lanes of an operator fit in its operator buffer.
+#define LANE_FRAMES (WAVES_BLOCK_SIZE / LANES)
+
+// Renders the `count` voices of the active voices starting at `first`, one
+// per lane, and mixes them into the `channels` channels of `mix`, panned if
+// there are two. Every operator is evaluated for all
+// lanes at once, its buffer holding frame `k` of lane `l` at k * LANES + l.
+// Lanes past `count` render silence and are masked out of the mix, released
+// voices are rendered like any other, their envelopes fading them out.
+// This is program_render() for groups of voices, for programs without
+// routes or feedback.
+static void lanes_render(WavesEngine *engine, RenderScratch *scratch,
+                         size_t first, size_t count, size_t frames,
+                         float (*mix)[WAVES_BLOCK_SIZE], size_t channels) {
+    const Program *program = engine->program;
+    const uint8_t *types = PROGRAM_ARRAY(program, types);
+    const float *frequency_ratios =
+        engine->parameters[WAVES_PARAMETER_FREQUENCY_RATIO];
+    const float *output_amplitudes =
+        engine->parameters[WAVES_PARAMETER_OUTPUT_AMPLITUDE];
+    const float *modulation_amplitudes =
+        engine->parameters[WAVES_PARAMETER_MODULATION_AMPLITUDE];
+    const uint32_t *inputs_starts = PROGRAM_ARRAY(program, inputs_starts);
+    const uint32_t *inputs_counts = PROGRAM_ARRAY(program, inputs_counts);
+    const OperatorInput *inputs = PROGRAM_ARRAY(program, inputs);
+    const uint32_t *merged_into = PROGRAM_ARRAY(program, merged_into);
+    size_t n = program->operator_count;
+    double sample_period = 1.0 / engine->sample_rate;
+
+    Voice *voices[LANES] = {0};
+    float gains[2][LANES] = {{0}};
+    for (size_t l = 0; l < count; l++) {
+        voices[l] = engine->voices + engine->active_voices[first + l];
+        for (size_t c = 0; c < channels; c++)
+            gains[c][l] = channels > 1 ? voices[l]->pan_gains[c] : 1;
+    }
+
+    // Phase increments of every operator and lane. An operator whose
+    // envelope has finished in every voice is silent for the whole block,
+    // as in program_render().
+    double steps[WAVES_MAX_OPERATORS][LANES] = {{0}};
+    float lane_phases[WAVES_MAX_OPERATORS][LANES] = {{0}};
+    float lane_steps[WAVES_MAX_OPERATORS][LANES] = {{0}};
+    uint64_t silent = 0;
+    for (size_t i = 0; i < n - 1; i++) {
+        int finished = 1;
+        for (size_t l = 0; l < count; l++) {
+            OperatorState *state = voices[l]->operators + i;
+            steps[i][l] =
+                voices[l]->frequency * frequency_ratios[i] * sample_period;
+            lane_phases[i][l] = state->phase;
+            lane_steps[i][l] = steps[i][l];
+            finished &= state->envelope_stage == ENVELOPE_OFF;
+        }
+        if (finished)
+            silent |= (uint64_t)1 << i;
+    }
+
+    float loudness[LANES] = {0};
+    Lanes radians_to_turns = lanes_set(0.5 / M_PI);
+    size_t chunk = 0;
+    for (size_t offset = 0; offset < frames; offset += chunk) {
+        chunk = frames - offset < LANE_FRAMES ? frames - offset : LANE_FRAMES;
+
+        for (size_t i = 0; i < n; i++) {
+            if (merged_into[i] != i || silent >> i & 1)
+                continue;
+
+            WaveformType type = types[i];
+            int is_output = type == WAVES_WAVEFORM_OUTPUT;
+            const float *amplitudes =
+                is_output ? output_amplitudes : modulation_amplitudes;
+
+            float modulation[WAVES_BLOCK_SIZE];
+            for (size_t k = 0; k < chunk; k++)
+                lanes_store(modulation + k * LANES, lanes_set(0));
+            for (size_t j = 0; j < inputs_counts[i]; j++) {
+                const OperatorInput *input = inputs + inputs_starts[i] + j;
+                uint32_t rendered = merged_into[input->source];
+                if (silent >> rendered & 1)
+                    continue;
+
+                const float *buffer = scratch->operator_buffers[rendered];
+                Lanes amplitude = lanes_set(amplitudes[input->source]);
+                for (size_t k = 0; k < chunk * LANES; k += LANES)
+                    lanes_store(modulation + k,
+                                lanes_fmadd(lanes_load(buffer + k),
+                                            amplitude,
+                                            lanes_load(modulation + k)));
+            }
+
+            if (is_output) {
+                // Voices are mixed in order, as in group_render()
+                for (size_t c = 0; c < channels; c++)
+                    for (size_t k = 0; k < chunk; k++)
+                        for (size_t l = 0; l < count; l++)
+                            mix[c][offset + k] +=
+                                modulation[k * LANES + l] * gains[c][l];
+                for (size_t k = 0; k < chunk; k++)
+                    for (size_t l = 0; l < count; l++)
+                        loudness[l] = fmaxf(loudness[l],
+                                            fabsf(modulation[k * LANES + l]));
+                continue;
+            }
+
+            // Held notes have constant envelopes, which are filled in for
+            // all lanes at once
+            float envelope[WAVES_BLOCK_SIZE];
+            float constant[LANES] = {0};
+            int is_constant = 1;
+            for (size_t l = 0; l < count && is_constant; l++) {
+                const OperatorState *state = voices[l]->operators + i;
+                constant[l] = state->envelope_level;
+                is_constant = state->envelope_stage == ENVELOPE_SUSTAIN ||
+                              state->envelope_stage == ENVELOPE_OFF;
+            }
+            if (is_constant) {
+                for (size_t k = 0; k < chunk * LANES; k += LANES)
+                    lanes_store(envelope + k, lanes_load(constant));
+            } else {
+                memset(envelope, 0, sizeof(envelope));
+                for (size_t l = 0; l < count; l++) {
+                    float levels[LANE_FRAMES];
+                    envelope_render(program, i, voices[l]->operators + i,
+                                    levels, chunk);
+                    for (size_t k = 0; k < chunk; k++)
+                        envelope[k * LANES + l] = levels[k];
+                }
+            }
+
+            float *out = scratch->operator_buffers[i];
+            Lanes phase = lanes_load(lane_phases[i]);
+            Lanes step = lanes_load(lane_steps[i]);
+            int is_sine = type == WAVES_WAVEFORM_SINE;
+            for (size_t k = 0; k < chunk; k++) {
+                Lanes frame = lanes_set(offset + k + 1);
+                Lanes argument = lanes_fmadd(frame, step, phase);
+                argument = lanes_fmadd(lanes_load(modulation + k * LANES),
+                                       radians_to_turns, argument);
+                if (is_sine)
+                    argument =
+                        lanes_mul(lanes_sin_turns(argument),
+                                  lanes_load(envelope + k * LANES));
+                lanes_store(out + k * LANES, argument);
+            }
+            if (is_sine)
+                continue;
+
+            // Band limiting depends on the pitch of the voice, the buffer
+            // holds the arguments of the wavetables
+            for (size_t l = 0; l < count; l++) {
+                const float *table = wavetable_get(type, steps[i][l]);
+                for (size_t k = 0; k < chunk; k++) {
+                    float *sample = out + k * LANES + l;
+                    *sample = wavetable_lookup(table, *sample) *
+                              envelope[k * LANES + l];
+                }
+            }
+        }
+    }
+
+    for (size_t l = 0; l < count; l++) {
+        OperatorState *states = voices[l]->operators;
+        for (size_t i = 0; i < n - 1; i++) {
+            if (merged_into[i] != i)
+                continue;
+
+            double next_phase = states[i].phase + frames * steps[i][l];
+            states[i].phase = next_phase - floor(next_phase);
+            states[i].last_output =
+                silent >> i & 1 ? 0
+                                : scratch->operator_buffers[i]
+                                      [(chunk - 1) * LANES + l];
+        }
+        voices[l]->loudness = loudness[l];
+    }
+}
+
+// Renders and mixes the voices of voice group `group` into its group mix.
+static void group_render(WavesEngine *engine, RenderScratch *scratch,
+                         size_t group, size_t frames) {
+    size_t channels = engine->job_channels;
+    float (*mix)[WAVES_BLOCK_SIZE] = engine->group_mixes[group];
+    for (size_t c = 0; c < channels; c++)
+        memset(mix[c], 0, frames * sizeof(float));
+
+    const Program *program = engine->program;
+    int generic =
+        atomic_load_explicit(&engine->kernels_disabled, memory_order_relaxed);
+    size_t first = group * VOICE_GROUP_SIZE;
+    size_t last = first + VOICE_GROUP_SIZE;
+    if (last > engine->active_voice_count)
+        last = engine->active_voice_count;
+
+    // Programs without a kernel of their own render several voices at once
+    if (LANES > 1 && !generic && !program->kernel && !program->route_count &&
+        !program->has_feedback && last - first > 1) {
+        lanes_render(engine, scratch, first, last - first, frames, mix,
+                     channels);
+        return;
+    }
+
+    ProgramRenderer render =
+        generic ? program_render : kernels[program->kernel].render;
+
+    static const float unpanned[1] = {1};
+    for (size_t i = first; i < last; i++) {
+        Voice *voice = engine->voices + engine->active_voices[i];
+        const float *gains = channels > 1 ? voice->pan_gains : unpanned;
+        float loudness = 0;
+
+        float *voice_out = render(engine, scratch, voice, frames);
+        for (size_t c = 0; c < channels; c++)
+            for (size_t j = 0; j < frames; j++)
+                mix[c][j] += voice_out[j] * gains[c];
+        for (size_t j = 0; j < frames; j++)
+            loudness = fmaxf(loudness, fabsf(voice_out[j]));
+
+        voice->loudness = loudness;
+    }
+}
+
+// Renders voice groups of the current block until there are none left.
+static void groups_render(WavesEngine *engine, RenderScratch *scratch) {
+    size_t group;
+    while ((group = atomic_fetch_add(&engine->next_group, 1)) <
+           engine->job_group_count)
+        group_render(engine, scratch, group, engine->job_frames);
+}
+
+static void *worker_main(void *arg) {
+    RenderWorker *worker = arg;
+    WavesEngine *engine = worker->engine;
+
+    while (1) {
+        sem_wait(&worker->start);
+        if (atomic_load(&engine->workers_quit))
+            break;
+
+        groups_render(engine, &worker->scratch);
+        atomic_fetch_sub_explicit(&engine->busy_workers, 1,
+                                  memory_order_release);
+    }
+
+    return 0;
+}
+
+static void workers_stop(WavesEngine *engine) {
+    if (!engine->workers)
+        return;
+
+    atomic_store(&engine->workers_quit, 1);
+    for (size_t i = 0; i < engine->worker_count; i++)
+        sem_post(&engine->workers[i].start);
+
+    for (size_t i = 0; i < engine->worker_count; i++) {
+        pthread_join(engine->workers[i].thread, 0);
+        sem_destroy(&engine->workers[i].start);
+    }
+
+    free(engine->workers);
+    engine->workers = 0;
+    engine->worker_count = 0;
+    atomic_store(&engine->workers_quit, 0);
+}
+
+void waves_set_kernels(WavesEngine *engine, int enabled) {
+    assert(engine);
+    atomic_store_explicit(&engine->kernels_disabled, !enabled,
+                          memory_order_relaxed);
+}
+
+void waves_set_render_threads(WavesEngine *engine, size_t thread_count) {
+    assert(engine);
+    assert(thread_count <= WAVES_MAX_RENDER_THREADS);
+
+    workers_stop(engine);
+    if (thread_count <= 1)
+        return;
+
+    // The thread calling waves_render_block() renders as well
+    engine->worker_count = thread_count - 1;
+    engine->workers = calloc(engine->worker_count, sizeof(RenderWorker));
+    assert(engine->workers);
+
+    for (size_t i = 0; i < engine->worker_count; i++) {
+        RenderWorker *worker = engine->workers + i;
+        worker->engine = engine;
+        if (sem_init(&worker->start, 0, 0) ||
+            pthread_create(&worker->thread, 0, worker_main, worker)) {
+            fprintf(stderr, "ERROR: Could not start render thread.\n");
+            abort();
+        }
+    }
+}
+
+// Waits without blocking until the workers have finished the current block.
+static void workers_wait(WavesEngine *engine) {
+    for (unsigned spins = 0; atomic_load_explicit(&engine->busy_workers,
+                                                  memory_order_acquire);
+         spins++) {
+        if (spins < 1024) {
+#if defined(__SSE2__)
+            _mm_pause();
+#endif
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+// Returns the voice to the pool, `index` is into `active_voices`.
+static void voice_free(WavesEngine *engine, size_t index) {
+    engine->free_voices[engine->free_voice_count++] =
+        engine->active_voices[index];
+    engine->active_voice_count--;
+    memmove(engine->active_voices + index, engine->active_voices + index + 1,
+            (engine->active_voice_count - index) * sizeof(uint16_t));
+}
+
+// Sets the polyphony, see WAVES_EVENT_POLYPHONY.
+static void voices_limit(WavesEngine *engine, size_t voice_count) {
+    engine->polyphony = voice_count;
+
+    // Cut the oldest voices above the new limit
+    while (engine->active_voice_count > engine->polyphony)
+        voice_free(engine, 0);
+}
+
+// Picks the index into `active_voices` of the voice to be replaced by a new
+// voice playing `note`, or returns `active_voice_count` if a new voice should
+// be allocated.
+static size_t voice_find_victim(WavesEngine *engine, uint8_t note) {
+    Voice *voices = engine->voices;
+    uint16_t *active = engine->active_voices;
+    size_t active_count = engine->active_voice_count;
+
+    if (engine->steal_policy == WAVES_STEAL_SAME_NOTE) {
+        for (size_t i = 0; i < active_count; i++)
+            if (voices[active[i]].note == note)
+                return i;
+    }
+
+    if (active_count < engine->polyphony)
+        return active_count;
+
+    if (engine->steal_policy == WAVES_STEAL_QUIETEST) {
+        size_t quietest = 0;
+        for (size_t i = 1; i < active_count; i++)
+            if (voices[active[i]].loudness < voices[active[quietest]].loudness)
+                quietest = i;
+        return quietest;
+    }
+
+    // Oldest, preferring voices that have already been released
+    for (size_t i = 0; i < active_count; i++)
+        if (voices[active[i]].released)
+            return i;
+    return 0;
+}
+
+// Starts a voice panned by `pan`, from -1 to 1. The channel on the side the
+// voice is panned to stays at full level, the other one fades out linearly.
+static void voice_note_on(WavesEngine *engine, uint8_t note, uint8_t velocity,
+                          float pan) {
+    assert(engine->free_voice_count + engine->active_voice_count ==
+           WAVES_MAX_VOICES);
+
+    size_t victim = voice_find_victim(engine, note);
+    if (victim < engine->active_voice_count) {
+#ifdef WAVES_STATS
+        // Retriggering a note below the polyphony steals nothing
+        if (engine->active_voice_count >= engine->polyphony)
+            engine->stats.stolen_voices++;
+#endif
+        voice_free(engine, victim);
+    }
+
+    uint16_t index = engine->free_voices[--engine->free_voice_count];
+    engine->active_voices[engine->active_voice_count++] = index;
+
+    Voice *voice = engine->voices + index;
+    voice->frequency = 440.0 * pow(2, (note - 69) / 12.0);
+    voice->loudness = 0;
+    voice->note = note;
+    voice->velocity = velocity;
+    voice->released = 0;
+    voice->pan_gains[0] = pan > 0 ? 1 - pan : 1;
+    voice->pan_gains[1] = pan < 0 ? 1 + pan : 1;
+    voice_start(engine->program, voice);
+}
+
+static void voice_note_off(WavesEngine *engine, uint8_t note) {
+    for (size_t i = 0; i < engine->active_voice_count; i++) {
+        Voice *voice = engine->voices + engine->active_voices[i];
+        if (voice->note == note && !voice->released)
+            voice_release(engine->program, voice);
+    }
+}
+
+static void voice_all_notes_off(WavesEngine *engine) {
+    for (size_t i = 0; i < engine->active_voice_count; i++) {
+        Voice *voice = engine->voices + engine->active_voices[i];
+        if (!voice->released)
+            voice_release(engine->program, voice);
+    }
+}
+
+static void event_apply(WavesEngine *engine, const WavesEvent *event) {
+    switch (event->type) {
+    case WAVES_EVENT_NOTE_ON:
+        voice_note_on(engine, event->note, event->velocity, event->value);
+        break;
+    case WAVES_EVENT_NOTE_OFF:
+        voice_note_off(engine, event->note);
+        break;
+    case WAVES_EVENT_ALL_NOTES_OFF:
+        voice_all_notes_off(engine);
+        break;
+    case WAVES_EVENT_MACRO:
+        engine->source_values[event->source] = event->value;
+        break;
+    case WAVES_EVENT_POLYPHONY:
+        voices_limit(engine, event->value);
+        break;
+    case WAVES_EVENT_STEAL_POLICY:
+        engine->steal_policy = event->steal_policy;
+        break;
+    case WAVES_EVENT_GAIN:
+        engine->gain_target = event->value;
+        engine->gain_step =
+            (engine->gain_target - engine->gain) / WAVES_CONTROL_INTERVAL;
+        engine->gain_remaining = WAVES_CONTROL_INTERVAL;
+        break;
+    case WAVES_EVENT_PARAMETER: {
+        const Program *program = engine->program;
+        const uint32_t *handles = PROGRAM_ARRAY(program, handles);
+        float *values = engine->parameters[event->parameter];
+        for (size_t i = 0; i < program->operator_count; i++)
+            if (handles[i] == event->waveform)
+                values[i] = event->value;
+        break;
+    }
+    }
+}
+
+int waves_send_event(WavesEngine *engine, const WavesEvent *event) {
+    assert(engine);
+    assert(event);
+    assert(event->type != WAVES_EVENT_NOTE_ON ||
+           (event->note < MIDI_NOTE_COUNT && fabsf(event->value) <= 1));
+    assert(event->type != WAVES_EVENT_MACRO ||
+           (event->source > WAVES_SOURCE_KEY &&
+            event->source < engine->source_count));
+    assert(event->type != WAVES_EVENT_POLYPHONY ||
+           (event->value >= 1 && event->value <= WAVES_MAX_VOICES &&
+            event->value == (size_t)event->value));
+    assert(event->type != WAVES_EVENT_STEAL_POLICY ||
+           event->steal_policy <= WAVES_STEAL_SAME_NOTE);
+    assert(event->type != WAVES_EVENT_PARAMETER ||
+           event->parameter < PARAMETER_COUNT);
+
+    size_t written =
+        atomic_load_explicit(&engine->events_written, memory_order_relaxed);
+    size_t read =
+        atomic_load_explicit(&engine->events_read, memory_order_acquire);
+    if (written - read >= WAVES_EVENT_QUEUE_SIZE)
+        return 0;
+
+    int stale = 0;
+    if (event->type == WAVES_EVENT_PARAMETER) {
+        // Keep the graph in sync, so that the value survives recompiling
+        Waveform *wf = wfvec_get(&engine->waveforms, event->waveform);
+        assert(wf);
+        float *value = WAVEFORM_PARAMETER(wf, event->parameter);
+        stale = program_stale(engine->published, event->waveform,
+                              event->parameter, *value, event->value);
+        *value = event->value;
+    }
+
+    // Publish graph edits before any event that might depend on them. The
+    // audio thread installs the program before applying the event, and
+    // keeps the previous value of a parameter until the event is applied.
+    if (engine->program_dirty || stale)
+        waves_compile(engine);
+
+    engine->events[written % WAVES_EVENT_QUEUE_SIZE] = *event;
+    atomic_store_explicit(&engine->events_written, written + 1,
+                          memory_order_release);
+    return 1;
+}
+
+uint64_t waves_get_time(WavesEngine *engine) {
+    assert(engine);
+    return atomic_load_explicit(&engine->time, memory_order_relaxed);
+}
+
+int waves_note_on(WavesEngine *engine, uint8_t note, uint8_t velocity) {
+    return waves_send_event(engine, &(WavesEvent){
+                                        .type = WAVES_EVENT_NOTE_ON,
+                                        .note = note,
+                                        .velocity = velocity,
+                                    });
+}
+
+int waves_note_off(WavesEngine *engine, uint8_t note) {
+    return waves_send_event(engine, &(WavesEvent){
+                                        .type = WAVES_EVENT_NOTE_OFF,
+                                        .note = note,
+                                    });
+}
+
+int waves_all_notes_off(WavesEngine *engine) {
+    return waves_send_event(engine, &(WavesEvent){
+                                        .type = WAVES_EVENT_ALL_NOTES_OFF,
+                                    });
+}
+
+int waves_waveform_set_parameter(WavesEngine *engine, WaveformHandle handle,
+                                 WaveformParameter parameter, float value) {
+    return waves_send_event(engine, &(WavesEvent){
+                                        .type = WAVES_EVENT_PARAMETER,
+                                        .waveform = handle,
+                                        .parameter = parameter,
+                                        .value = value,
+                                    });
+}
+
+int waves_set_macro(WavesEngine *engine, WavesSource macro, float value) {
+    return waves_send_event(engine, &(WavesEvent){
+                                        .type = WAVES_EVENT_MACRO,
+                                        .source = macro,
+                                        .value = value,
+                                    });
+}
+
+int waves_set_polyphony(WavesEngine *engine, size_t voice_count) {
+    return waves_send_event(engine, &(WavesEvent){
+                                        .type = WAVES_EVENT_POLYPHONY,
+                                        .value = voice_count,
+                                    });
+}
+
+int waves_set_steal_policy(WavesEngine *engine, WavesStealPolicy policy) {
+    return waves_send_event(engine, &(WavesEvent){
+                                        .type = WAVES_EVENT_STEAL_POLICY,
+                                        .steal_policy = policy,
+                                    });
+}
+
+int waves_set_gain(WavesEngine *engine, float gain) {
+    return waves_send_event(engine, &(WavesEvent){
+                                        .type = WAVES_EVENT_GAIN,
+                                        .value = gain,
+                                    });
+}
+
+// Applies the events due at or before `time`. Returns the number of frames
+// until the next pending event, or `frames` if there is none before that.
+static size_t events_apply(WavesEngine *engine, uint64_t time,
+                           size_t frames) {
+    size_t read =
+        atomic_load_explicit(&engine->events_read, memory_order_relaxed);
+    size_t written =
+        atomic_load_explicit(&engine->events_written, memory_order_acquire);
+
+    // Programs are published before the events sent after them, which may
+    // depend on them
+    program_swap(engine);
+
+    for (; read != written; read++) {
+        WavesEvent *event = engine->events + read % WAVES_EVENT_QUEUE_SIZE;
+        if (event->time > time) {
+            if (event->time - time < frames)
+                frames = event->time - time;
+            break;
+        }
+
+        event_apply(engine, event);
+    }
+
+    atomic_store_explicit(&engine->events_read, read, memory_order_release);
+    return frames;
+}
+
+// Caller buffers of a render call. Channel `c` of frame `j` is written to
+// interleaved[j * channel_count + c], or to planes[c][j] if there is no
+// interleaved buffer.
+typedef struct {
+    float *interleaved;
+    float *const *planes;
+    size_t channel_count;
+    // Frames written so far
+    size_t offset;
+} OutputBuffers;
+
+// Returns where the next frame of channel `channel` goes, the frames after it
+// are `stride` samples apart.
+static float *output_channel(const OutputBuffers *output, size_t channel,
+                             size_t *stride) {
+    if (output->interleaved) {
+        *stride = output->channel_count;
+        return output->interleaved + output->offset * output->channel_count +
+               channel;
+    }
+
+    *stride = 1;
+    return output->planes[channel] + output->offset;
+}
+
+// Writes the output gain of the next `frames` frames to `out`.
+static void gain_render(WavesEngine *engine, float *out, size_t frames) {
+    for (size_t j = 0; j < frames; j++) {
+        if (engine->gain_remaining) {
+            engine->gain += engine->gain_step;
+            // Land exactly on the target
+            if (!--engine->gain_remaining)
+                engine->gain = engine->gain_target;
+        }
+        out[j] = engine->gain;
+    }
+}
+
+// Renders a block of at most WAVES_BLOCK_SIZE frames. The group mixes are
+// summed straight into the caller's buffers.
+static void block_render(WavesEngine *engine, const OutputBuffers *output,
+                         size_t frames) {
+    size_t group_count =
+        (engine->active_voice_count + VOICE_GROUP_SIZE - 1) / VOICE_GROUP_SIZE;
+
+    engine->job_frames = frames;
+    engine->job_channels = output->channel_count > 1 ? 2 : 1;
+    engine->job_group_count = group_count;
+    atomic_store(&engine->next_group, 0);
+
+    // Only wake up as many workers as there are groups for
+    size_t helpers = group_count ? group_count - 1 : 0;
+    if (helpers > engine->worker_count)
+        helpers = engine->worker_count;
+    atomic_store(&engine->busy_workers, helpers);
+    for (size_t i = 0; i < helpers; i++)
+        sem_post(&engine->workers[i].start);
+
+    groups_render(engine, &engine->scratch);
+    workers_wait(engine);
+
+    float gains[WAVES_BLOCK_SIZE];
+    gain_render(engine, gains, frames);
+
+    for (size_t c = 0; c < output->channel_count; c++) {
+        size_t stride;
+        float *out = output_channel(output, c, &stride);
+
+        // Channels after the first two are silent
+        float sum[WAVES_BLOCK_SIZE] = {0};
+        for (size_t i = 0; i < group_count && c < engine->job_channels; i++) {
+            float *mix = engine->group_mixes[i][c];
+            for (size_t j = 0; j < frames; j++)
+                sum[j] += mix[j];
+        }
+
+        for (size_t j = 0; j < frames; j++)
+            out[j * stride] = sum[j] * gains[j];
+    }
+
+    // Voices are retired at block granularity, their envelopes have already
+    // reached zero by then.
+    for (size_t i = engine->active_voice_count; i-- > 0;) {
+        Voice *voice = engine->voices + engine->active_voices[i];
+        if (voice_is_silent(engine->program, voice))
+            voice_free(engine, i);
+    }
+}
+
+#ifdef WAVES_STATS
+_Static_assert(sizeof(WavesStats) % sizeof(uint64_t) == 0,
+               "WavesStats is published in 64 bit words");
+
+// Accounts for a waves_render_block() call of `frames` frames started at
+// `start`, and publishes the statistics.
+static void stats_update(WavesEngine *engine, const struct timespec *start,
+                         size_t frames) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) * 1e-9;
+    double load = frames ? seconds * engine->sample_rate / frames : 0;
+
+    WavesStats *stats = &engine->stats;
+    if (!stats->blocks || seconds < stats->block_time_min)
+        stats->block_time_min = seconds;
+    if (seconds > stats->block_time_max)
+        stats->block_time_max = seconds;
+    stats->blocks++;
+    engine->stats_time_total += seconds;
+    stats->block_time_avg = engine->stats_time_total / stats->blocks;
+    stats->load = load * 100;
+
+    size_t bin = load * 10;
+    if (bin >= WAVES_STATS_HISTOGRAM_BINS)
+        bin = WAVES_STATS_HISTOGRAM_BINS - 1;
+    stats->load_histogram[bin]++;
+    if (load > 1)
+        stats->overruns++;
+    stats->active_voices = engine->active_voice_count;
+
+    uint64_t words[sizeof(WavesStats) / sizeof(uint64_t)];
+    memcpy(words, stats, sizeof(WavesStats));
+
+    unsigned sequence = atomic_load_explicit(&engine->stats_sequence,
+                                             memory_order_relaxed);
+    atomic_store_explicit(&engine->stats_sequence, sequence + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (size_t i = 0; i < sizeof(words) / sizeof(*words); i++)
+        atomic_store_explicit(&engine->stats_words[i], words[i],
+                              memory_order_relaxed);
+    atomic_store_explicit(&engine->stats_sequence, sequence + 2,
+                          memory_order_release);
+}
+#endif
+
+int waves_get_stats(WavesEngine *engine, WavesStats *stats) {
+    assert(engine);
+    assert(stats);
+
+#ifdef WAVES_STATS
+    uint64_t words[sizeof(WavesStats) / sizeof(uint64_t)];
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&engine->stats_sequence,
+                                      memory_order_acquire);
+        for (size_t i = 0; i < sizeof(words) / sizeof(*words); i++)
+            words[i] = atomic_load_explicit(&engine->stats_words[i],
+                                            memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&engine->stats_sequence,
+                                     memory_order_relaxed);
+    } while (before != after || before % 2);
+
+    memcpy(stats, words, sizeof(WavesStats));
+    return 1;
+#else
+    memset(stats, 0, sizeof(WavesStats));
+    return 0;
+#endif
+}
+
+static void output_render(WavesEngine *engine, OutputBuffers *output,
+                          size_t frames) {
+#ifdef WAVES_STATS
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t requested_frames = frames;
+#endif
+
+    uint64_t time =
+        atomic_load_explicit(&engine->time, memory_order_relaxed);
+
+    while (frames) {
+        size_t block = frames < WAVES_BLOCK_SIZE ? frames : WAVES_BLOCK_SIZE;
+
+        // Split the block at the next event, so that every event takes effect
+        // on its exact frame
+        block = events_apply(engine, time, block);
+
+        block_render(engine, output, block);
+
+        time += block;
+        atomic_store_explicit(&engine->time, time, memory_order_relaxed);
+        output->offset += block;
+        frames -= block;
+    }
+
+#ifdef WAVES_STATS
+    stats_update(engine, &start, requested_frames);
+#endif
+}
+
+void waves_render_block(WavesEngine *engine, float *out, size_t frames) {
+    waves_render_interleaved(engine, out, 1, frames);
+}
+
+void waves_render_interleaved(WavesEngine *engine, float *out,
+                              size_t channel_count, size_t frames) {
+    assert(engine);
+    assert(out || !frames);
+    assert(channel_count);
+
+    OutputBuffers output = {
+        .interleaved = out,
+        .channel_count = channel_count,
+    };
+    output_render(engine, &output, frames);
+}
+
+void waves_render_planar(WavesEngine *engine, float *const *out,
+                         size_t channel_count, size_t frames) {
+    assert(engine);
+    assert(channel_count);
+    assert(out || !frames);
+    for (size_t c = 0; c < channel_count && frames; c++)
+        assert(out[c]);
 
-    return sample;
+    OutputBuffers output = {
+        .planes = out,
+        .channel_count = channel_count,
+    };
+    output_render(engine, &output, frames);
 }
@@ -0,0 +1,877 @@
+#include "waves.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+   Offline renderer, renders a patch and a score to a float32 WAV file as
+   fast as possible, mono unless another channel count is given with -c.
+
+   render [-r sample_rate] [-c channels] [-t threads] [-l tail] patch score
+          out.wav
+   render [-r sample_rate] [-c channels] [-l tail] [-j jobs] -b batch_file
+   render [-r sample_rate] -B bank.wvb patch...
+
+   Patch files are text, one statement per line, `#` starts a comment:
+
+   waveform <name> <sine|triangle|saw|square> <ratio> <output_amplitude>
+            <modulation_amplitude>
+   envelope <name> <attack> <decay> <sustain> <release> [linear|exponential]
+   connect <from> <to>         (`output` is the audible output waveform)
+   polyphony <voices>
+   macro <name>
+   route <source> <waveform> <output|modulation|ratio> <depth>
+                               (source is `velocity`, `key` or a macro)
+
+   Patches can also be given as `bank.wvb[:index]`, patch `index` (0 by
+   default) of a bank written with -B, which compiles text patches into a
+   bank in order. Banks do not store polyphony.
+
+   Scores are either Standard MIDI Files (.mid) or text with one event per
+   line, times in seconds:
+
+   <time> on <note> <velocity> [pan]
+                               (pan from -1 to 1, centered by default)
+   <time> off <note>
+   <time> alloff
+   <time> macro <name> <value>
+   <time> gain <value>
+   <time> end                  (length of the render, instead of the tail)
+
+   MIDI notes are panned by the last pan controller (CC 10) of their channel.
+
+   Batch files list one job per line as `patch score out.wav`, the jobs are
+   rendered in parallel.
+*/
+
+#define DEFAULT_SAMPLE_RATE 48000
+// Seconds rendered after the last event when the score has no `end`
+#define DEFAULT_TAIL 2.0
+#define RENDER_CHUNK 4096
+#define MAX_NAME 64
+// Channels of the WAV files, the first two are left and right
+#define MAX_CHANNELS 8
+
+typedef struct {
+    char name[MAX_NAME];
+    WaveformHandle handle;
+} NamedWaveform;
+
+typedef struct {
+    double time;
+    WavesEvent event;
+} ScoreEvent;
+
+typedef struct {
+    ScoreEvent *events;
+    size_t count;
+    size_t allocated;
+    // Length of the render in seconds, negative if not given
+    double end;
+} Score;
+
+typedef struct {
+    float sample_rate;
+    size_t channels;
+    size_t threads;
+    double tail;
+} RenderOptions;
+
+typedef struct {
+    const char *patch;
+    const char *score;
+    const char *out;
+    double seconds_rendered;
+    double seconds_taken;
+    int failed;
+} Job;
+
+static void score_append(Score *score, double time, WavesEvent event) {
+    if (score->count >= score->allocated) {
+        score->allocated = score->allocated ? score->allocated * 2 : 64;
+        score->events =
+            realloc(score->events, score->allocated * sizeof(ScoreEvent));
+        if (!score->events)
+            abort();
+    }
+    score->events[score->count++] = (ScoreEvent){time, event};
+}
+
+static int score_event_compare(const void *a, const void *b) {
+    double time_a = ((const ScoreEvent *)a)->time;
+    double time_b = ((const ScoreEvent *)b)->time;
+    return (time_a > time_b) - (time_a < time_b);
+}
+
+static WaveformHandle patch_find(NamedWaveform *named, size_t count,
+                                 const char *name) {
+    if (!strcmp(name, "output"))
+        return WAVES_OUTPUT;
+    for (size_t i = 0; i < count; i++)
+        if (!strcmp(named[i].name, name))
+            return named[i].handle;
+    return 0;
+}
+
+static int parameter_parse(const char *name, WaveformParameter *parameter) {
+    static const char *names[] = {"output", "modulation", "ratio"};
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(name, names[i])) {
+            *parameter = WAVES_PARAMETER_OUTPUT_AMPLITUDE + i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int waveform_type_parse(const char *name, WaveformType *type) {
+    static const char *names[] = {"sine", "triangle", "saw", "square"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        if (!strcmp(name, names[i])) {
+            *type = WAVES_WAVEFORM_SINE + i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Selects the bank patch `spec`, `bank.wvb[:index]`, on `engine`. The bank
+// is returned in `bank` and must outlive the engine. Returns 0 on failure.
+static int patch_load_bank(WavesEngine *engine, const char *spec,
+                           WavesBank **bank) {
+    char path[320];
+    snprintf(path, sizeof(path), "%s", spec);
+    long index = 0;
+    char *separator = strrchr(path, ':');
+    if (separator && separator > strstr(path, ".wvb")) {
+        *separator = 0;
+        index = atol(separator + 1);
+    }
+
+    *bank = waves_bank_load(path);
+    if (!*bank) {
+        fprintf(stderr, "ERROR: Could not load bank %s.\n", path);
+        return 0;
+    }
+    if (index < 0 || (size_t)index >= waves_bank_patch_count(*bank)) {
+        fprintf(stderr, "ERROR: Bank %s has no patch %ld.\n", path, index);
+        return 0;
+    }
+
+    waves_bank_select(engine, *bank, index);
+    return 1;
+}
+
+// Builds the patch `path` into `engine`, a text patch or a bank patch which
+// is returned in `bank`. Returns 0 on failure.
+static int patch_load(WavesEngine *engine, const char *path,
+                      WavesBank **bank) {
+    if (strstr(path, ".wvb"))
+        return patch_load_bank(engine, path, bank);
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "ERROR: Could not open patch %s.\n", path);
+        return 0;
+    }
+
+    NamedWaveform named[WAVES_MAX_OPERATORS * 4];
+    size_t named_count = 0;
+    char line[256];
+    int line_number = 0;
+    int ok = 1;
+
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+
+        char keyword[16], name[MAX_NAME], other[MAX_NAME];
+        float a, b, c, d;
+        int count;
+
+        if (sscanf(line, "%15s", keyword) != 1)
+            continue;
+
+        if (!strcmp(keyword, "waveform")) {
+            WaveformType type;
+            ok = sscanf(line, "%*s %63s %63s %f %f %f", name, other, &a, &b,
+                        &c) == 5 &&
+                 waveform_type_parse(other, &type) &&
+                 named_count < sizeof(named) / sizeof(*named) &&
+                 !patch_find(named, named_count, name);
+            if (ok) {
+                strcpy(named[named_count].name, name);
+                named[named_count++].handle =
+                    waves_new_waveform(engine, type, a, b, c);
+            }
+        } else if (!strcmp(keyword, "envelope")) {
+            other[0] = 0;
+            count = sscanf(line, "%*s %63s %f %f %f %f %63s", name, &a, &b, &c,
+                           &d, other);
+            WaveformHandle handle = patch_find(named, named_count, name);
+            ok = count >= 5 && handle && handle != WAVES_OUTPUT;
+            if (ok)
+                waves_waveform_set_envelope(
+                    engine, handle,
+                    (Envelope){
+                        .attack = a,
+                        .decay = b,
+                        .sustain = c,
+                        .release = d,
+                        .curve = strcmp(other, "exponential")
+                                     ? WAVES_CURVE_LINEAR
+                                     : WAVES_CURVE_EXPONENTIAL,
+                    });
+        } else if (!strcmp(keyword, "connect")) {
+            ok = sscanf(line, "%*s %63s %63s", name, other) == 2;
+            WaveformHandle from = ok ? patch_find(named, named_count, name) : 0;
+            WaveformHandle to = ok ? patch_find(named, named_count, other) : 0;
+            ok = from && to && from != WAVES_OUTPUT;
+            if (ok)
+                waves_connect_waveforms(engine, from, to);
+        } else if (!strcmp(keyword, "macro")) {
+            ok = sscanf(line, "%*s %31s", name) == 1 &&
+                 !waves_find_source(engine, name);
+            if (ok)
+                waves_new_macro(engine, name);
+        } else if (!strcmp(keyword, "route")) {
+            char parameter_name[16];
+            WaveformParameter parameter;
+            ok = sscanf(line, "%*s %31s %63s %15s %f", other, name,
+                        parameter_name, &a) == 4 &&
+                 parameter_parse(parameter_name, &parameter);
+            WavesSource source = ok ? waves_find_source(engine, other) : 0;
+            WaveformHandle handle =
+                ok ? patch_find(named, named_count, name) : 0;
+            ok = source && handle && handle != WAVES_OUTPUT;
+            if (ok)
+                waves_route(engine, source, handle, parameter, a);
+        } else if (!strcmp(keyword, "polyphony")) {
+            ok = sscanf(line, "%*s %d", &count) == 1 && count > 0 &&
+                 count <= WAVES_MAX_VOICES;
+            if (ok)
+                waves_set_polyphony(engine, count);
+        } else {
+            ok = 0;
+        }
+    }
+
+    if (!ok)
+        fprintf(stderr, "ERROR: %s:%d: Invalid statement.\n", path,
+                line_number);
+
+    fclose(file);
+    return ok;
+}
+
+// Macros are looked up by name in `engine`.
+static int score_load_text(WavesEngine *engine, Score *score,
+                           const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "ERROR: Could not open score %s.\n", path);
+        return 0;
+    }
+
+    char line[256];
+    int line_number = 0;
+    int ok = 1;
+
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+
+        double time;
+        char keyword[16];
+        int note = 0, velocity = 0;
+        float pan = 0;
+        int count = sscanf(line, "%lf %15s %d %d %f", &time, keyword, &note,
+                           &velocity, &pan);
+        if (count <= 0)
+            continue;
+
+        ok = count >= 2 && time >= 0 && note >= 0 && note < 128 &&
+             velocity >= 0 && velocity < 128 && fabsf(pan) <= 1;
+        if (!ok)
+            break;
+
+        if (!strcmp(keyword, "on") && (count == 4 || count == 5))
+            score_append(score, time,
+                         (WavesEvent){
+                             .type = WAVES_EVENT_NOTE_ON,
+                             .note = note,
+                             .velocity = velocity,
+                             .value = pan,
+                         });
+        else if (!strcmp(keyword, "off") && count == 3)
+            score_append(score, time,
+                         (WavesEvent){
+                             .type = WAVES_EVENT_NOTE_OFF,
+                             .note = note,
+                         });
+        else if (!strcmp(keyword, "alloff"))
+            score_append(score, time,
+                         (WavesEvent){.type = WAVES_EVENT_ALL_NOTES_OFF});
+        else if (!strcmp(keyword, "macro")) {
+            char name[WAVES_MAX_SOURCE_NAME];
+            float value;
+            WavesSource source = 0;
+            if (sscanf(line, "%*f %*s %31s %f", name, &value) == 2)
+                source = waves_find_source(engine, name);
+            ok = source > WAVES_SOURCE_KEY;
+            if (ok)
+                score_append(score, time,
+                             (WavesEvent){
+                                 .type = WAVES_EVENT_MACRO,
+                                 .source = source,
+                                 .value = value,
+                             });
+        } else if (!strcmp(keyword, "gain")) {
+            float value;
+            ok = sscanf(line, "%*f %*s %f", &value) == 1;
+            if (ok)
+                score_append(score, time,
+                             (WavesEvent){
+                                 .type = WAVES_EVENT_GAIN,
+                                 .value = value,
+                             });
+        } else if (!strcmp(keyword, "end"))
+            score->end = time;
+        else
+            ok = 0;
+    }
+
+    if (!ok)
+        fprintf(stderr, "ERROR: %s:%d: Invalid event.\n", path, line_number);
+
+    fclose(file);
+    return ok;
+}
+
+static uint32_t read_be(const uint8_t *data, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = value << 8 | data[i];
+    return value;
+}
+
+// Reads a variable-length quantity, returns 0 if it runs past `end`.
+static int read_vlq(const uint8_t **data, const uint8_t *end,
+                    uint32_t *value) {
+    *value = 0;
+    for (int i = 0; i < 4 && *data < end; i++) {
+        uint8_t byte = *(*data)++;
+        *value = *value << 7 | (byte & 0x7f);
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    uint32_t tick;
+    // Tempo changes have a note of 0xff and the tempo in `tempo`
+    uint32_t tempo;
+    // Pan changes of MIDI channel `channel` have a note of 0xfe and the pan
+    // in `event.value`
+    uint8_t channel;
+    WavesEvent event;
+} MidiEvent;
+
+static int midi_event_compare(const void *a, const void *b) {
+    const MidiEvent *event_a = a, *event_b = b;
+    if (event_a->tick != event_b->tick)
+        return event_a->tick < event_b->tick ? -1 : 1;
+    // Keep the track order of simultaneous events
+    return (event_a > event_b) - (event_a < event_b);
+}
+
+// Parses note on and note off events, pan controllers and the tempo map of a
+// Standard MIDI File of format 0 or 1, on every channel.
+static int score_load_midi(Score *score, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "ERROR: Could not open score %s.\n", path);
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    int ok = data && size >= 14 && fread(data, 1, size, file) == (size_t)size;
+    fclose(file);
+
+    uint32_t division = 0;
+    uint32_t track_count = 0;
+    if (ok) {
+        ok = !memcmp(data, "MThd", 4) && read_be(data + 4, 4) >= 6;
+        track_count = read_be(data + 10, 2);
+        division = read_be(data + 12, 2);
+        // SMPTE time division is not supported
+        ok = ok && division && !(division & 0x8000);
+    }
+
+    MidiEvent *events = 0;
+    size_t event_count = 0, events_allocated = 0;
+    const uint8_t *chunk = ok ? data + 8 + read_be(data + 4, 4) : data;
+    const uint8_t *data_end = data + size;
+
+    for (uint32_t track = 0; ok && track < track_count; track++) {
+        ok = data_end - chunk >= 8 && !memcmp(chunk, "MTrk", 4) &&
+             read_be(chunk + 4, 4) <= (uint32_t)(data_end - chunk - 8);
+        if (!ok)
+            break;
+
+        const uint8_t *cursor = chunk + 8;
+        const uint8_t *end = cursor + read_be(chunk + 4, 4);
+        chunk = end;
+
+        uint32_t tick = 0;
+        uint8_t status = 0;
+        while (ok && cursor < end) {
+            uint32_t delta;
+            ok = read_vlq(&cursor, end, &delta) && cursor < end;
+            if (!ok)
+                break;
+            tick += delta;
+
+            if (*cursor & 0x80)
+                status = *cursor++;
+            else if (!status)
+                ok = 0;
+
+            MidiEvent event = {.tick = tick};
+            int keep = 0;
+            uint32_t length;
+
+            if (status == 0xff) {
+                ok = end - cursor >= 1;
+                uint8_t type = ok ? *cursor++ : 0;
+                ok = ok && read_vlq(&cursor, end, &length) &&
+                     length <= (uint32_t)(end - cursor);
+                if (ok && type == 0x51 && length == 3) {
+                    event.tempo = read_be(cursor, 3);
+                    event.event.note = 0xff;
+                    keep = 1;
+                }
+                cursor += ok ? length : 0;
+                status = 0;
+            } else if (status == 0xf0 || status == 0xf7) {
+                ok = read_vlq(&cursor, end, &length) &&
+                     length <= (uint32_t)(end - cursor);
+                cursor += ok ? length : 0;
+                status = 0;
+            } else if (ok) {
+                uint8_t kind = status & 0xf0;
+                int data_bytes = kind == 0xc0 || kind == 0xd0 ? 1 : 2;
+                ok = end - cursor >= data_bytes;
+                event.channel = status & 0x0f;
+                if (ok && (kind == 0x80 || kind == 0x90)) {
+                    int velocity = cursor[1] & 0x7f;
+                    event.event = (WavesEvent){
+                        .type = kind == 0x90 && velocity
+                                    ? WAVES_EVENT_NOTE_ON
+                                    : WAVES_EVENT_NOTE_OFF,
+                        .note = cursor[0] & 0x7f,
+                        .velocity = velocity,
+                    };
+                    keep = 1;
+                } else if (ok && kind == 0xb0 && cursor[0] == 10) {
+                    // 64 is centered, 0 and 127 all the way to a side
+                    int value = cursor[1] & 0x7f;
+                    event.event.note = 0xfe;
+                    event.event.value = fmaxf((value - 64) / 63.0f, -1);
+                    keep = 1;
+                }
+                cursor += data_bytes;
+            }
+
+            if (ok && keep) {
+                if (event_count >= events_allocated) {
+                    events_allocated = events_allocated ? events_allocated * 2
+                                                        : 256;
+                    events =
+                        realloc(events, events_allocated * sizeof(MidiEvent));
+                    if (!events)
+                        abort();
+                }
+                events[event_count++] = event;
+            }
+        }
+    }
+
+    if (ok) {
+        qsort(events, event_count, sizeof(MidiEvent), midi_event_compare);
+
+        // Default tempo of 120 bpm, channels start centered
+        double seconds_per_tick = 0.5 / division;
+        double time = 0;
+        uint32_t tick = 0;
+        float pans[16] = {0};
+        for (size_t i = 0; i < event_count; i++) {
+            MidiEvent *event = events + i;
+            time += (event->tick - tick) * seconds_per_tick;
+            tick = event->tick;
+            if (event->event.note == 0xff) {
+                seconds_per_tick = event->tempo / 1e6 / division;
+            } else if (event->event.note == 0xfe) {
+                pans[event->channel] = event->event.value;
+            } else {
+                if (event->event.type == WAVES_EVENT_NOTE_ON)
+                    event->event.value = pans[event->channel];
+                score_append(score, time, event->event);
+            }
+        }
+    } else {
+        fprintf(stderr, "ERROR: %s is not a valid Standard MIDI File.\n",
+                path);
+    }
+
+    free(events);
+    free(data);
+    return ok;
+}
+
+static int score_load(WavesEngine *engine, Score *score, const char *path) {
+    *score = (Score){.end = -1};
+    size_t length = strlen(path);
+    int ok = length > 4 && !strcmp(path + length - 4, ".mid")
+                 ? score_load_midi(score, path)
+                 : score_load_text(engine, score, path);
+
+    // Text scores may be out of order, MIDI events are sorted already
+    qsort(score->events, score->count, sizeof(ScoreEvent),
+          score_event_compare);
+    return ok;
+}
+
+static int wav_write(const char *path, const float *frames, size_t count,
+                     uint16_t channels, uint32_t sample_rate) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "ERROR: Could not open %s for writing.\n", path);
+        return 0;
+    }
+
+    uint32_t frame_size = channels * sizeof(float);
+    uint32_t data_size = count * frame_size;
+    uint8_t header[44];
+    uint32_t fields[][2] = {
+        {0, 0x46464952},
+        {4, 36 + data_size},
+        {8, 0x45564157},
+        {12, 0x20746d66},
+        {16, 16},
+        // IEEE float format and the channel count
+        {20, 3 | (uint32_t)channels << 16},
+        {24, sample_rate},
+        {28, sample_rate * frame_size},
+        // Bytes per frame and 32 bits per sample
+        {32, frame_size | 32 << 16},
+        {36, 0x61746164},
+        {40, data_size},
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++)
+        for (int j = 0; j < 4; j++)
+            header[fields[i][0] + j] = fields[i][1] >> (8 * j);
+
+    // WAV is little endian, as are the samples on the supported platforms,
+    // and interleaved
+    size_t samples = count * channels;
+    int ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+             fwrite(frames, sizeof(float), samples, file) == samples;
+    ok = !fclose(file) && ok;
+    if (!ok)
+        fprintf(stderr, "ERROR: Could not write %s.\n", path);
+    return ok;
+}
+
+static double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Renders a single job, events are fed to the engine just ahead of the
+// frames being rendered so the event queue never overflows.
+static void job_run(Job *job, const RenderOptions *options) {
+    WavesEngine *engine = waves_engine_create(options->sample_rate);
+    waves_set_render_threads(engine, options->threads);
+
+    Score score = {.end = -1};
+    WavesBank *bank = 0;
+    job->failed = !patch_load(engine, job->patch, &bank);
+    job->failed = !score_load(engine, &score, job->score) || job->failed;
+
+    double seconds = score.end;
+    if (seconds < 0)
+        seconds = (score.count ? score.events[score.count - 1].time : 0) +
+                  options->tail;
+    size_t frame_count = seconds * options->sample_rate;
+    size_t channels = options->channels;
+    float *frames = 0;
+    // Patches from a bank are rendered in place, as selected
+    if (!job->failed && !bank && !waves_compile(engine)) {
+        fprintf(stderr,
+                "ERROR: Patch %s has more than %u reachable waveforms.\n",
+                job->patch, WAVES_MAX_OPERATORS);
+        job->failed = 1;
+    }
+    if (!job->failed)
+        frames = malloc((frame_count ? frame_count : 1) * channels *
+                        sizeof(float));
+
+    if (!job->failed) {
+        double start = seconds_now();
+
+        size_t next = 0;
+        for (size_t frame = 0; frame < frame_count;) {
+            size_t chunk = frame_count - frame;
+            if (chunk > RENDER_CHUNK)
+                chunk = RENDER_CHUNK;
+
+            for (; next < score.count; next++) {
+                WavesEvent event = score.events[next].event;
+                event.time = score.events[next].time * options->sample_rate;
+                if (event.time >= frame + chunk)
+                    break;
+                if (!waves_send_event(engine, &event)) {
+                    // Queue full, stop at the first event that did not fit
+                    chunk = event.time > frame ? event.time - frame : 1;
+                    break;
+                }
+            }
+
+            waves_render_interleaved(engine, frames + frame * channels,
+                                     channels, chunk);
+            frame += chunk;
+        }
+
+        job->seconds_taken = seconds_now() - start;
+        job->seconds_rendered = seconds;
+        job->failed = !wav_write(job->out, frames, frame_count, channels,
+                                 options->sample_rate);
+    }
+
+    free(frames);
+    free(score.events);
+    waves_engine_destroy(engine);
+    waves_bank_free(bank);
+}
+
+static void job_report(const Job *job) {
+    if (job->failed) {
+        printf("%s: failed\n", job->out);
+        return;
+    }
+
+    printf("%s: %.2f s of audio in %.3f s, %.1fx realtime\n", job->out,
+           job->seconds_rendered, job->seconds_taken,
+           job->seconds_rendered / job->seconds_taken);
+}
+
+typedef struct {
+    Job *jobs;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+    const RenderOptions *options;
+} Batch;
+
+static void *batch_worker(void *arg) {
+    Batch *batch = arg;
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        size_t index = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (index >= batch->count)
+            return 0;
+
+        job_run(batch->jobs + index, batch->options);
+    }
+}
+
+static int batch_run(const char *path, size_t thread_count,
+                     const RenderOptions *options) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "ERROR: Could not open batch file %s.\n", path);
+        return 1;
+    }
+
+    Batch batch = {.options = options};
+    size_t allocated = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+
+        char patch[320], score[320], out[320];
+        if (sscanf(line, "%319s %319s %319s", patch, score, out) != 3)
+            continue;
+
+        if (batch.count >= allocated) {
+            allocated = allocated ? allocated * 2 : 16;
+            batch.jobs = realloc(batch.jobs, allocated * sizeof(Job));
+            if (!batch.jobs)
+                abort();
+        }
+        batch.jobs[batch.count++] = (Job){
+            .patch = strdup(patch),
+            .score = strdup(score),
+            .out = strdup(out),
+        };
+    }
+    fclose(file);
+
+    if (thread_count > batch.count)
+        thread_count = batch.count;
+
+    double start = seconds_now();
+    pthread_mutex_init(&batch.lock, 0);
+    pthread_t *threads = malloc((thread_count + 1) * sizeof(pthread_t));
+    for (size_t i = 0; i < thread_count; i++)
+        if (pthread_create(threads + i, 0, batch_worker, &batch))
+            abort();
+    for (size_t i = 0; i < thread_count; i++)
+        pthread_join(threads[i], 0);
+    double seconds_taken = seconds_now() - start;
+
+    double seconds_rendered = 0;
+    int failed = 0;
+    for (size_t i = 0; i < batch.count; i++) {
+        Job *job = batch.jobs + i;
+        job_report(job);
+        seconds_rendered += job->seconds_rendered;
+        failed |= job->failed;
+        free((char *)job->patch);
+        free((char *)job->score);
+        free((char *)job->out);
+    }
+
+    printf("batch: %zu jobs, %.2f s of audio in %.3f s on %zu threads, "
+           "%.1fx realtime\n",
+           batch.count, seconds_rendered, seconds_taken, thread_count,
+           seconds_taken > 0 ? seconds_rendered / seconds_taken : 0);
+
+    pthread_mutex_destroy(&batch.lock);
+    free(threads);
+    free(batch.jobs);
+    return failed;
+}
+
+// Compiles the text patches `paths` into a bank at `path`.
+static int bank_write(const char *path, char **paths, size_t count,
+                      const RenderOptions *options) {
+    WavesEngine **engines = malloc((count ? count : 1) * sizeof(WavesEngine *));
+    if (!engines)
+        abort();
+
+    int ok = 1;
+    for (size_t i = 0; i < count; i++) {
+        engines[i] = waves_engine_create(options->sample_rate);
+        WavesBank *bank = 0;
+        ok = patch_load(engines[i], paths[i], &bank) && ok;
+        waves_bank_free(bank);
+    }
+
+    if (ok && !waves_bank_save(path, engines, count)) {
+        fprintf(stderr, "ERROR: Could not write bank %s.\n", path);
+        ok = 0;
+    }
+    if (ok)
+        printf("%s: %zu patches\n", path, count);
+
+    for (size_t i = 0; i < count; i++)
+        waves_engine_destroy(engines[i]);
+    free(engines);
+    return !ok;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: render [-r sample_rate] [-c channels] [-t threads] "
+            "[-l tail] patch score out.wav\n"
+            "       render [-r sample_rate] [-c channels] [-l tail] "
+            "[-j jobs] -b batch_file\n"
+            "       render [-r sample_rate] -B bank.wvb patch...\n");
+}
+
+int main(int argc, char **argv) {
+    RenderOptions options = {
+        .sample_rate = DEFAULT_SAMPLE_RATE,
+        .channels = 1,
+        .threads = 1,
+        .tail = DEFAULT_TAIL,
+    };
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *batch_file = 0;
+    const char *bank_file = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "r:c:t:l:j:b:B:")) != -1) {
+        switch (option) {
+        case 'r':
+            options.sample_rate = atof(optarg);
+            break;
+        case 'c':
+            options.channels = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'l':
+            options.tail = atof(optarg);
+            break;
+        case 'j':
+            jobs = atol(optarg);
+            break;
+        case 'b':
+            batch_file = optarg;
+            break;
+        case 'B':
+            bank_file = optarg;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+
+    if (options.sample_rate <= 0 || options.tail < 0 ||
+        options.channels < 1 || options.channels > MAX_CHANNELS ||
+        options.threads > WAVES_MAX_RENDER_THREADS) {
+        usage();
+        return 2;
+    }
+
+    if (batch_file)
+        return batch_run(batch_file, jobs > 0 ? jobs : 1, &options);
+    if (bank_file)
+        return bank_write(bank_file, argv + optind, argc - optind, &options);
+
+    if (argc - optind != 3) {
+        usage();
+        return 2;
+    }
+
+    Job job = {
+        .patch = argv[optind],
+        .score = argv[optind + 1],
+        .out = argv[optind + 2],
+    };
+    job_run(&job, &options);
+    job_report(&job);
+    return job.failed;
+}